@@ -7,102 +7,115 @@
 
 #include <linux/device/driver.h>
 #include <linux/i2c.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
 #include <linux/of.h>
 
 #include "7-segment.h"
 
-extern ssize_t seven_segment_write_proc_file(struct seven_segment_display *ssd, struct file* f, const char __user* buf, size_t sz);
-extern ssize_t seven_segment_read_proc_file(struct seven_segment_display *ssd, struct file* f, char __user** buf, loff_t **off);
-extern int seven_segment_register_top_proc_dir(void);
-extern void seven_segment_create_proc_files(struct proc_dir_entry* parent, struct proc_ops* pops);
-
-extern struct proc_dir_entry *procparent;
+// Sends the prepared updates of batch[first..last) with one i2c_transfer(). They share the adapter.
+static void seven_segment_group_send_i2c(struct seven_segment_group *group, int first, int last){
+    struct seven_segment_group_member *member;
+    struct i2c_msg *msgs;
+    int i, n = 0, ret, err;
+    u64 start;
+
+    // runs from the group's work, only i2c groups pay for the messages
+    msgs = kmalloc_array(last - first, sizeof(*msgs), GFP_KERNEL);
+    if (!msgs){
+        ret = -ENOMEM;
+        goto fail;
+    }
 
-static size_t i2c_client_counter = 0;
-static struct i2c_client* clients[SEVENSEGMENT_MAX_CLIENTS];
+    for (i = first; i < last; ++i){
+        member = &group->batch[i];
+        if (!member->len)
+            continue;
 
-static size_t seven_segment_get_free_idx(void){
-    if (!i2c_client_counter || !clients[0]){
-        return 0;
+        msgs[n].addr = member->ssd->device.i2c->addr;
+        msgs[n].flags = member->ssd->device.i2c->flags & I2C_M_TEN;
+        msgs[n].len = member->len;
+        msgs[n].buf = (u8 *)member->buf;
+        ++n;
     }
 
-    if (!clients[1])
-        return 1;
-
-    return 2;
-}
+    if (!n){
+        kfree(msgs);
+        return;
+    }
 
-static ssize_t seven_segment_get_client_idx(struct i2c_client *client){
-    ssize_t i;
-    for (i = 0; i < SEVENSEGMENT_MAX_CLIENTS; ++i){
-        if (clients[i] == client)
-            return i;
+    start = ktime_get_ns();
+    ret = i2c_transfer(group->batch[first].ssd->device.i2c->adapter, msgs, n);
+    kfree(msgs);
+    err = ret == n ? 0 : ret < 0 ? ret : -EIO;
+    for (i = first; i < last; ++i){
+        member = &group->batch[i];
+        if (member->len)
+            seven_segment_account(member->ssd, member->buf, member->len, err ? err : member->len, start);
+    }
+    if (!err)
+        return;
+
+fail:
+    // there is no telling which messages made it
+    pr_err_ratelimited("Could not send group update on i2c-%d. Error: %d\n", group->batch[first].ssd->device.i2c->adapter->nr, ret);
+    for (i = first; i < last; ++i){
+        if (group->batch[i].len)
+            seven_segment_update_failed(group->batch[i].ssd, group->batch[i].sent);
     }
-    return -1;
 }
 
+static int seven_segment_i2c_send(struct seven_segment_display *ssd, char *cmd, size_t len, unsigned long sent){
+    return i2c_master_send(ssd->device.i2c, cmd, len);
+}
 
-static ssize_t seven_segment_proc_write(struct file* f, const char __user* buf, size_t sz, loff_t* off){
-    size_t idx;
-    struct seven_segment_display* ssd;
-    struct i2c_client* client;
-
-    idx = f->f_path.dentry->d_parent->d_iname[0] - 48;
-    client = clients[idx];
-    ssd = i2c_get_clientdata(client);
+static void *seven_segment_i2c_bus_adapter(struct seven_segment_display *ssd){
+    return ssd->device.i2c->adapter;
+}
 
-    sz = seven_segment_write_proc_file(ssd, f, buf, sz);
-    return sz;
+static void seven_segment_i2c_bus_name(struct seven_segment_display *ssd, char *name, size_t sz){
+    snprintf(name, sz, "i2c-%d", ssd->device.i2c->adapter->nr);
 }
 
-ssize_t	seven_segment_proc_read(struct file *f, char __user *buf, size_t sz, loff_t *off){
-    ssize_t ret;
-    size_t idx;
-    struct seven_segment_display* ssd;
-    struct i2c_client *client;
-    idx = f->f_path.dentry->d_parent->d_iname[0] - 48;
-    client = clients[idx];
-    ssd = i2c_get_clientdata(client);
-    ret = seven_segment_read_proc_file(ssd, f, &buf, &off);
+static const char *seven_segment_i2c_name(struct seven_segment_display *ssd){
+    return ssd->device.i2c->name;
+}
 
-    return ret;
+static struct device *seven_segment_i2c_dev(struct seven_segment_display *ssd){
+    return &ssd->device.i2c->dev;
 }
 
-static struct proc_ops pops = {
-    .proc_write = seven_segment_proc_write,
-    .proc_read = seven_segment_proc_read
+static const struct seven_segment_transport seven_segment_i2c_transport = {
+    .type = SEVENSEGMENT_I2C,
+    .send = seven_segment_i2c_send,
+    .group_send = seven_segment_group_send_i2c,
+    .bus_adapter = seven_segment_i2c_bus_adapter,
+    .bus_name = seven_segment_i2c_bus_name,
+    .name = seven_segment_i2c_name,
+    .dev = seven_segment_i2c_dev,
 };
 
 static int seven_segment_probe(struct i2c_client *client){
-    int client_idx;
-    char procfsname[2];
-
-    if (i2c_client_counter >= SEVENSEGMENT_MAX_CLIENTS - 1){
-        pr_err("Too many displays present! Max 3 are allowed.\n");
-        return -ENFILE;
-    }
-
-    client_idx = seven_segment_get_free_idx();
-    clients[client_idx] = client;
-    ++i2c_client_counter;
-
-    procfsname[0] = client_idx + 48;
-    procfsname[1] = 0;
-
-    if (!procparent){
-        pr_err("procparent doesn't exist!\n");
+    int ret;
+    struct seven_segment_display *ssd = kzalloc(sizeof(struct seven_segment_display), GFP_KERNEL);
+    if (!ssd)
         return -ENOMEM;
+
+    ret = seven_segment_init_display(ssd);
+    if (ret){
+        kfree(ssd);
+        return ret;
     }
 
-    struct seven_segment_display *ssd = kmalloc(sizeof(struct seven_segment_display), GFP_KERNEL);
-    ssd->procfolder = proc_mkdir(procfsname, procparent);
     ssd->device.i2c = client;
-    ssd->device_type = SEVENSEGMENT_I2C;
+    ssd->transport = &seven_segment_i2c_transport;
 
-    if (!ssd->procfolder)
-        pr_err("could not create ssd->procfolder!\n");
-
-    seven_segment_create_proc_files(ssd->procfolder, &pops);
+    ret = seven_segment_register_display(ssd);
+    if (ret){
+        seven_segment_release_display(ssd);
+        seven_segment_put_display(ssd);
+        return ret;
+    }
 
     i2c_set_clientdata(client, ssd);
 
@@ -110,17 +123,11 @@ static int seven_segment_probe(struct i2c_client *client){
 }
 
 static void seven_segment_remove(struct i2c_client *client){
-    size_t idx;
     struct seven_segment_display *ssd;
     ssd = i2c_get_clientdata(client);
-    proc_remove(ssd->procfolder);
-
-    idx = seven_segment_get_client_idx(client);
-    if (idx >= 0) {
-        clients[idx] = NULL;
-        --i2c_client_counter;
-    }
-    kfree(ssd);
+    seven_segment_unregister_display(ssd);
+    seven_segment_release_display(ssd);
+    seven_segment_put_display(ssd);
 }
 
 static struct i2c_driver seven_segment_i2c_driver = {
@@ -129,28 +136,23 @@ static struct i2c_driver seven_segment_i2c_driver = {
     .driver = {
         .name = "sev_segment",
         .of_match_table = seven_segment_match,
-        .owner = THIS_MODULE
+        .owner = THIS_MODULE,
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS
     }
 };
 
 static int __init seven_segment_init(void){
     int ret;
 
-    ret = seven_segment_register_top_proc_dir();
-    if (ret)
-        goto out;
-
     ret = i2c_register_driver(THIS_MODULE, &seven_segment_i2c_driver);
     if (ret){
         pr_err("Failed to register i2c driver: %d\n", ret);
     }
-out:
     return ret;
 }
 
 static void __exit seven_segment_exit(void){
     i2c_del_driver(&seven_segment_i2c_driver);
-    proc_remove(procparent);
 }
 
 MODULE_DEVICE_TABLE(of, seven_segment_match);
@@ -0,0 +1,88 @@
+#ifndef SEVENSEGMENT_IOCTL_H
+#define SEVENSEGMENT_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Binary interface of /dev/ssdN. A write() of exactly one struct ssd_frame
+ * replaces the whole content of the display, a read() returns the current one.
+ */
+
+// segments[i] holds a character instead of a segment bitmap, one bit per digit. The bytes the
+// display takes as commands, 0x76-0x7e and 0x81, are not valid characters.
+#define SSD_FRAME_CHARS             0x0f
+#define SSD_FRAME_CHAR(i)           (1 << (i))
+// leave the decimals/brightness of the display as they are, ignore the field
+#define SSD_FRAME_KEEP_DECIMALS     0x10
+#define SSD_FRAME_KEEP_BRIGHTNESS   0x20
+// send this frame before the pending updates of other displays on the same bus
+#define SSD_FRAME_URGENT            0x40
+
+struct ssd_frame {
+    __u8 segments[4];   // segment bitmap (0-127), or character, see SSD_FRAME_CHARS
+    __u8 decimals;      // 0-63
+    __u8 brightness;    // 0-100
+    __u8 flags;         // SSD_FRAME_*
+    __u8 reserved;      // must be 0
+};
+
+/*
+ * mmap() of /dev/ssdN maps one page, starting with struct ssd_shared. It holds
+ * the current frame of the display whenever seq is even; an odd seq means the
+ * frame is being written. To update the display, read an even seq, change it to
+ * seq + 1 with a compare-and-swap (retry if that fails), write frame, then store
+ * seq + 2 with release semantics. The kernel picks the change up within one
+ * refresh period, and rewrites the page the same way whenever the state changes
+ * through any other interface - unless a frame written by userspace is still
+ * pending, that one wins. Readers retry while seq is odd, or changed while they
+ * copied the frame. Invalid frames are ignored, and overwritten with the
+ * current state.
+ */
+struct ssd_shared {
+    __u32 seq;
+    __u32 reserved;
+    struct ssd_frame frame;
+};
+
+/*
+ * Animations are played by the kernel: each frame is shown for duration_ms
+ * (10-60000), then the next one follows. Without SSD_ANIM_LOOP played frames
+ * are dropped, and the last one stays on the display. With SSD_ANIM_APPEND
+ * the frames are queued after the ones of the running animation, which keeps
+ * its looping mode. Uploading zero frames without SSD_ANIM_APPEND stops the
+ * animation, so does any other write of the digits.
+ */
+#define SSD_ANIM_MAX_FRAMES 32
+#define SSD_ANIM_LOOP       0x01
+#define SSD_ANIM_APPEND     0x02
+
+struct ssd_anim_frame {
+    struct ssd_frame frame;
+    __u32 duration_ms;
+};
+
+struct ssd_animation {
+    __u32 count;        // number of used frames
+    __u32 flags;        // SSD_ANIM_*
+    struct ssd_anim_frame frames[SSD_ANIM_MAX_FRAMES];
+};
+
+/*
+ * poll() on /dev/ssdN reports EPOLLIN once the state changed since the file was
+ * opened, or since the last read() or SSD_IOC_GET_EVENT on it. generation counts
+ * the changes of the display, it only grows.
+ */
+struct ssd_event {
+    __u64 generation;
+    struct ssd_frame frame;
+};
+
+#define SSD_IOC_MAGIC       'S'
+#define SSD_IOC_GET_FRAME   _IOR(SSD_IOC_MAGIC, 0, struct ssd_frame)
+#define SSD_IOC_SET_FRAME   _IOW(SSD_IOC_MAGIC, 1, struct ssd_frame)
+#define SSD_IOC_CLEAR       _IO(SSD_IOC_MAGIC, 2)
+#define SSD_IOC_ANIMATE     _IOW(SSD_IOC_MAGIC, 3, struct ssd_animation)
+#define SSD_IOC_GET_EVENT   _IOR(SSD_IOC_MAGIC, 4, struct ssd_event)
+
+#endif // SEVENSEGMENT_IOCTL_H
@@ -7,124 +7,242 @@
 
 #include <linux/device/driver.h>
 #include <linux/spi/spi.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
 #include <linux/of.h>
+#include <linux/property.h>
 
 #include "7-segment.h"
 
-extern ssize_t seven_segment_write_proc_file(struct seven_segment_display *ssd, struct file* f, const char __user* buf, size_t sz);
-extern ssize_t seven_segment_read_proc_file(struct seven_segment_display *ssd, struct file* f, char __user** buf, loff_t **off);
-extern int seven_segment_register_top_proc_dir(void);
-extern void seven_segment_create_proc_files(struct proc_dir_entry* parent, struct proc_ops* pops);
+// messages a display can have in flight
+#define SEVENSEGMENT_SPI_SLOTS      2
+// fastest spi clock the display's controller supports
+#define SEVENSEGMENT_SPI_MAX_HZ     250000
+
+struct seven_segment_spi;
+
+// A pre-built spi message with its own DMA-safe buffer.
+struct seven_segment_spi_slot {
+    struct seven_segment_spi *sd;
+    struct spi_message msg;
+    struct spi_transfer xfer;
+    u8 *buf;                            // kmalloc-ed, SEVENSEGMENT_FRAME_MAX bytes
+    unsigned long sent;                 // SEVENSEGMENT_DIRTY_* bits carried by the message
+    u64 start;                          // ktime_get_ns() at submission
+    bool busy;                          // submitted, waiting for completion
+};
 
-extern struct proc_dir_entry *procparent;
+struct seven_segment_spi {
+    struct seven_segment_display ssd;   // must come first, the core frees it
+    struct seven_segment_spi_slot slots[SEVENSEGMENT_SPI_SLOTS];
+    int next;                           // slot used by the next message
+    wait_queue_head_t wait;             // woken up when a slot completes
+};
 
-//static struct proc_dir_entry *procparent;
+static struct seven_segment_spi *seven_segment_to_spi(struct seven_segment_display *ssd){
+    return container_of(ssd, struct seven_segment_spi, ssd);
+}
 
-static struct spi_device* clients[SEVENSEGMENT_MAX_CLIENTS];
-static size_t spi_client_counter = 0;
+static void seven_segment_spi_complete(void *context){
+    struct seven_segment_spi_slot *slot = context;
+    struct seven_segment_spi *sd = slot->sd;
+    struct seven_segment_display *ssd = &sd->ssd;
+    unsigned long flags;
 
-static size_t seven_segment_get_free_idx(void){
-    if (!spi_client_counter || !clients[0]){
-        return 0;
+    seven_segment_account(ssd, slot->buf, slot->xfer.len, slot->msg.status, slot->start);
+    if (slot->msg.status < 0){
+        pr_err_ratelimited("ssd%d: could not send spi message. Error: %d\n", ssd->idx, slot->msg.status);
+        seven_segment_update_failed(ssd, slot->sent);
     }
 
-    if (!clients[1])
-        return 1;
+    spin_lock_irqsave(&sd->wait.lock, flags);
+    slot->busy = false;
+    wake_up_locked(&sd->wait);
+    spin_unlock_irqrestore(&sd->wait.lock, flags);
+}
+
+static bool seven_segment_spi_slot_free(struct seven_segment_spi *sd, struct seven_segment_spi_slot *slot){
+    unsigned long flags;
+    bool busy;
 
-    return 2;
+    spin_lock_irqsave(&sd->wait.lock, flags);
+    busy = slot->busy;
+    spin_unlock_irqrestore(&sd->wait.lock, flags);
+    return !busy;
 }
 
-static ssize_t seven_segment_get_client_idx(struct spi_device *client){
-    ssize_t i;
-    for (i = 0; i < SEVENSEGMENT_MAX_CLIENTS; ++i){
-        if (clients[i] == client)
-            return i;
+static bool seven_segment_spi_idle(struct seven_segment_spi *sd){
+    int i;
+
+    for (i = 0; i < SEVENSEGMENT_SPI_SLOTS; ++i){
+        if (!seven_segment_spi_slot_free(sd, &sd->slots[i]))
+            return false;
     }
-    return -1;
+    return true;
 }
 
+// Queues cmd on the spi controller without waiting for it to be sent. Messages to the same
+// display complete in order, failures are handled by seven_segment_spi_complete.
+static int seven_segment_spi_submit(struct seven_segment_display *ssd, char* cmd, size_t len, unsigned long sent){
+    struct seven_segment_spi *sd = seven_segment_to_spi(ssd);
+    struct seven_segment_spi_slot *slot = &sd->slots[sd->next];
+    int ret;
+
+    // slots are used in turn, so only this one can be still in flight
+    wait_event(sd->wait, seven_segment_spi_slot_free(sd, slot));
 
-static ssize_t seven_segment_proc_write(struct file* f, const char __user* buf, size_t sz, loff_t* off){
-    size_t idx;
-    struct seven_segment_display* ssd;
-    struct spi_device* client;
+    memcpy(slot->buf, cmd, len);
+    slot->xfer.len = len;
+    slot->sent = sent;
+    slot->start = ktime_get_ns();
+    slot->busy = true;
 
-    idx = f->f_path.dentry->d_parent->d_iname[0] - 48;
-    client = clients[idx];
-    ssd = spi_get_drvdata(client);
+    ret = spi_async(ssd->device.spi, &slot->msg);
+    if (ret){
+        slot->busy = false;
+        return ret;
+    }
 
-    sz = seven_segment_write_proc_file(ssd, f, buf, sz);
-    return sz;
+    sd->next = (sd->next + 1) % SEVENSEGMENT_SPI_SLOTS;
+    return len;
 }
 
+static int seven_segment_spi_init(struct seven_segment_spi *sd){
+    struct seven_segment_spi_slot *slot;
+    int i;
+
+    init_waitqueue_head(&sd->wait);
+    for (i = 0; i < SEVENSEGMENT_SPI_SLOTS; ++i){
+        slot = &sd->slots[i];
+        // kmalloc memory is suitable for DMA, unlike the stack
+        slot->buf = kmalloc(SEVENSEGMENT_FRAME_MAX, GFP_KERNEL);
+        if (!slot->buf)
+            goto err;
+
+        slot->sd = sd;
+        slot->xfer.tx_buf = slot->buf;
+        spi_message_init_with_transfers(&slot->msg, &slot->xfer, 1);
+        slot->msg.complete = seven_segment_spi_complete;
+        slot->msg.context = slot;
+    }
+    return 0;
 
-ssize_t	seven_segment_proc_read(struct file *f, char __user *buf, size_t sz, loff_t *off){
-    ssize_t ret;
-    size_t idx;
-    struct seven_segment_display *ssd;
-    struct spi_device *client;
-    idx = f->f_path.dentry->d_parent->d_iname[0] - 48;
-    client = clients[idx];
+err:
+    while (i--)
+        kfree(sd->slots[i].buf);
+    return -ENOMEM;
+}
+
+static void seven_segment_spi_release(struct seven_segment_display *ssd){
+    struct seven_segment_spi *sd = seven_segment_to_spi(ssd);
+    int i;
 
-    ssd = spi_get_drvdata(client);
-    ret = seven_segment_read_proc_file(ssd, f, &buf, &off);
+    wait_event(sd->wait, seven_segment_spi_idle(sd));
+    for (i = 0; i < SEVENSEGMENT_SPI_SLOTS; ++i)
+        kfree(sd->slots[i].buf);
+}
 
+static int seven_segment_spi_setup(struct seven_segment_display *ssd){
+    int ret = seven_segment_spi_init(seven_segment_to_spi(ssd));
+    if (ret)
+        pr_err("Could not allocate spi buffers\n");
     return ret;
 }
 
-static struct proc_ops pops = {
-    .proc_write = seven_segment_proc_write,
-    .proc_read = seven_segment_proc_read
+static void *seven_segment_spi_bus_adapter(struct seven_segment_display *ssd){
+    return ssd->device.spi->controller;
+}
+
+static void seven_segment_spi_bus_name(struct seven_segment_display *ssd, char *name, size_t sz){
+    snprintf(name, sz, "spi%d", ssd->device.spi->controller->bus_num);
+}
+
+static const char *seven_segment_spi_name(struct seven_segment_display *ssd){
+    return dev_name(&ssd->device.spi->dev);
+}
+
+static struct device *seven_segment_spi_dev(struct seven_segment_display *ssd){
+    return &ssd->device.spi->dev;
+}
+
+static const struct seven_segment_transport seven_segment_spi_transport = {
+    .type = SEVENSEGMENT_SPI,
+    .async = true,
+    .setup = seven_segment_spi_setup,
+    .teardown = seven_segment_spi_release,
+    .send = seven_segment_spi_submit,
+    .bus_adapter = seven_segment_spi_bus_adapter,
+    .bus_name = seven_segment_spi_bus_name,
+    .name = seven_segment_spi_name,
+    .dev = seven_segment_spi_dev,
 };
 
-static int seven_segment_probe(struct spi_device *spi){
-    int client_idx;
-    char procfsname[2];
+// Applies spi-max-frequency and bits-per-word from the device tree, within the display's limits.
+static int seven_segment_setup_spi(struct spi_device *spi){
+    u32 bits = 8;
+    int ret;
+
+    if (!spi->max_speed_hz || spi->max_speed_hz > SEVENSEGMENT_SPI_MAX_HZ)
+        spi->max_speed_hz = SEVENSEGMENT_SPI_MAX_HZ;
 
-    if (spi_client_counter >= SEVENSEGMENT_MAX_CLIENTS - 1){
-        pr_err("Too many displays present! Max 3 are allowed.\n");
-        return -ENFILE;
+    // the commands are byte streams, with 16 bit words every odd length one would be padded
+    device_property_read_u32(&spi->dev, "bits-per-word", &bits);
+    if (bits != 8){
+        pr_err("Unsupported bits-per-word: %u\n", bits);
+        return -EINVAL;
     }
+    spi->bits_per_word = bits;
+
+    ret = spi_setup(spi);
+    if (ret)
+        pr_err("Could not set up spi device: %d\n", ret);
+    return ret;
+}
 
-    client_idx = seven_segment_get_free_idx();
-    clients[client_idx] = spi;
-    ++spi_client_counter;
+static int seven_segment_probe(struct spi_device *spi){
+    int ret;
+    struct seven_segment_spi *sd;
+    struct seven_segment_display *ssd;
 
-    procfsname[0] = client_idx + 48;
-    procfsname[1] = 0;
+    // the core frees the display once its last user is gone
+    BUILD_BUG_ON(offsetof(struct seven_segment_spi, ssd) != 0);
 
-    if (!procparent){
-        pr_err("procparent doesn't exist!\n");
+    ret = seven_segment_setup_spi(spi);
+    if (ret)
+        return ret;
+
+    sd = kzalloc(sizeof(struct seven_segment_spi), GFP_KERNEL);
+    if (!sd)
         return -ENOMEM;
+    ssd = &sd->ssd;
+
+    ret = seven_segment_init_display(ssd);
+    if (ret){
+        kfree(sd);
+        return ret;
     }
 
-    struct seven_segment_display *ssd = kmalloc(sizeof(struct seven_segment_display), GFP_KERNEL);
-    ssd->procfolder = proc_mkdir(procfsname, procparent);
     ssd->device.spi = spi;
-    ssd->device_type = SEVENSEGMENT_SPI;
+    ssd->transport = &seven_segment_spi_transport;
 
-    if (!ssd->procfolder)
-        pr_err("could not create ssd->procfolder!\n");
+    ret = seven_segment_register_display(ssd);
+    if (ret){
+        seven_segment_release_display(ssd);
+        seven_segment_put_display(ssd);
+        return ret;
+    }
 
-    seven_segment_create_proc_files(ssd->procfolder, &pops);
     spi_set_drvdata(spi, ssd);
 
     return 0;
 }
 
 static void seven_segment_remove(struct spi_device *spi){
-    size_t idx;
     struct seven_segment_display *ssd;
     ssd = spi_get_drvdata(spi);
-    proc_remove(ssd->procfolder);
-
-    idx = seven_segment_get_client_idx(spi);
-    if (idx >= 0) {
-        clients[idx] = NULL;
-        --spi_client_counter;
-    }
-
-    kfree(spi_get_drvdata(spi));
+    seven_segment_unregister_display(ssd);
+    seven_segment_release_display(ssd);
+    seven_segment_put_display(ssd);
 }
 
 MODULE_DEVICE_TABLE(of, seven_segment_match);
@@ -141,28 +259,23 @@ static struct spi_driver seven_segment_driver = {
     .driver = {
         .name = "sev_segment_spi",
         .of_match_table = seven_segment_match,
-        .owner = THIS_MODULE
+        .owner = THIS_MODULE,
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS
     }
 };
 
 static int __init seven_segment_init(void){
     int ret;
 
-    ret = seven_segment_register_top_proc_dir();
-    if (ret)
-        goto out;
-
     ret = spi_register_driver(&seven_segment_driver);
     if (ret){
         pr_err("Failed to register driver: %d\n", ret);
     }
-out:
     return ret;
 }
 
 static void __exit seven_segment_exit(void){
     spi_unregister_driver(&seven_segment_driver);
-    proc_remove(procparent);
 }
 
 module_init(seven_segment_init);
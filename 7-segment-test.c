@@ -0,0 +1,452 @@
+// KUnit tests and microbenchmarks of the core. Included at the end of 7-segment.c, so the static
+// functions can be tested directly. Built with "make SSD_KUNIT=1", run when ssd-core is loaded.
+
+#include <kunit/test.h>
+
+#define SEVENSEGMENT_TEST_BENCH_LOOPS   100000
+#define SEVENSEGMENT_TEST_BENCH_UPDATES 1000
+
+// A display on a transport that only records what it's asked to send
+struct seven_segment_test_display {
+    struct seven_segment_display ssd;   // must come first, the core frees it
+    char sent[64];
+    size_t len;
+    int transfers;
+};
+
+static int seven_segment_test_send(struct seven_segment_display *ssd, char *cmd, size_t len, unsigned long sent){
+    struct seven_segment_test_display *td = container_of(ssd, struct seven_segment_test_display, ssd);
+
+    if (td->len + len <= sizeof(td->sent))
+        memcpy(td->sent + td->len, cmd, len);
+    td->len += len;
+    ++td->transfers;
+    return len;
+}
+
+static const struct seven_segment_transport seven_segment_test_transport = {
+    .type = SEVENSEGMENT_VIRTUAL,
+    .send = seven_segment_test_send,
+};
+
+// The display isn't registered, only put on a bus of its own, which it releases with itself.
+static int seven_segment_test_init(struct kunit *test){
+    struct seven_segment_test_display *td;
+    int ret;
+
+    td = kzalloc(sizeof(*td), GFP_KERNEL);
+    if (!td)
+        return -ENOMEM;
+
+    ret = seven_segment_init_display(&td->ssd);
+    if (ret){
+        kfree(td);
+        return ret;
+    }
+
+    td->ssd.transport = &seven_segment_test_transport;
+    td->ssd.bus = seven_segment_alloc_bus(&seven_segment_test_transport, td);
+    if (!td->ssd.bus){
+        seven_segment_release_display(&td->ssd);
+        seven_segment_put_display(&td->ssd);
+        return -ENOMEM;
+    }
+
+    test->priv = td;
+    return 0;
+}
+
+static void seven_segment_test_exit(struct kunit *test){
+    struct seven_segment_test_display *td = test->priv;
+
+    seven_segment_release_display(&td->ssd);
+    seven_segment_put_display(&td->ssd);
+}
+
+// Writes text to a file the way a write to /proc/ssd/N/<file> does, and waits until the update went
+// through the bus. The recorder holds only what this write sent.
+static ssize_t seven_segment_test_write(struct seven_segment_test_display *td, enum SevenSegmentProcFile file, const char *text){
+    char buf[SEVENSEGMENT_WRITE_MAX + 1];
+    ssize_t ret;
+
+    strscpy(buf, text, sizeof(buf));
+    td->len = 0;
+    td->transfers = 0;
+
+    mutex_lock(&td->ssd.write_lock);
+    ret = seven_segment_apply_attr(&td->ssd, file, buf);
+    mutex_unlock(&td->ssd.write_lock);
+    if (ret >= 0)
+        seven_segment_schedule_flush(&td->ssd);
+
+    flush_delayed_work(&td->ssd.flush_work);
+    flush_delayed_work(&td->ssd.bus->work);
+    return ret;
+}
+
+static ssize_t seven_segment_test_commit(struct seven_segment_test_display *td, const char *text){
+    return seven_segment_test_write(td, SEVENSEGMENT_COMMIT_FILE, text);
+}
+
+// A valid write, and what it's expected to send: nothing if it changes nothing
+struct seven_segment_test_write_case {
+    const char *text;
+    const char *sent;
+    size_t len;
+};
+
+// Writes the cases one after the other, checks what each sent, and that the invalid values are
+// rejected without sending anything
+static void seven_segment_test_writes(struct kunit *test, enum SevenSegmentProcFile file,
+                                      const struct seven_segment_test_write_case *cases, int count,
+                                      const char * const *invalid, int invalid_count){
+    struct seven_segment_test_display *td = test->priv;
+    int i;
+
+    for (i = 0; i < count; ++i){
+        KUNIT_ASSERT_GT_MSG(test, seven_segment_test_write(td, file, cases[i].text), 0, "%s", cases[i].text);
+        KUNIT_ASSERT_EQ_MSG(test, td->len, cases[i].len, "%s", cases[i].text);
+        if (cases[i].len)
+            KUNIT_EXPECT_MEMEQ_MSG(test, td->sent, cases[i].sent, td->len, "%s", cases[i].text);
+        KUNIT_EXPECT_EQ_MSG(test, td->transfers, cases[i].len ? 1 : 0, "%s", cases[i].text);
+    }
+
+    for (i = 0; i < invalid_count; ++i){
+        KUNIT_EXPECT_EQ_MSG(test, seven_segment_test_write(td, file, invalid[i]), -EINVAL, "%s", invalid[i]);
+        KUNIT_EXPECT_EQ_MSG(test, td->transfers, 0, "%s", invalid[i]);
+    }
+}
+
+static void seven_segment_test_encode_chars(struct kunit *test){
+    struct seven_segment_frame fb = { .cells = "12 4", .chars = SEVENSEGMENT_DIRTY_CELLS };
+    const char all[] = { SEVENSEGMENT_CURSOR_CTRL, 0, '1', '2', ' ', '4' };
+    const char gap[] = { SEVENSEGMENT_CURSOR_CTRL, 1, '2', SEVENSEGMENT_CURSOR_CTRL, 3, '4' };
+    const char clear[] = { SEVENSEGMENT_CLEAR_SCREEN, '1', '2', ' ', '4' };
+    char cmd[SEVENSEGMENT_FRAME_MAX];
+    size_t len;
+
+    // consecutive characters share one cursor move
+    len = seven_segment_encode_update(&fb, SEVENSEGMENT_DIRTY_CELLS, false, cmd);
+    KUNIT_ASSERT_EQ(test, len, sizeof(all));
+    KUNIT_EXPECT_MEMEQ(test, cmd, all, len);
+
+    len = seven_segment_encode_update(&fb, SEVENSEGMENT_DIRTY_CELL(1) | SEVENSEGMENT_DIRTY_CELL(3), false, cmd);
+    KUNIT_ASSERT_EQ(test, len, sizeof(gap));
+    KUNIT_EXPECT_MEMEQ(test, cmd, gap, len);
+
+    // clearing moves the cursor home
+    len = seven_segment_encode_update(&fb, SEVENSEGMENT_DIRTY_CELLS, true, cmd);
+    KUNIT_ASSERT_EQ(test, len, sizeof(clear));
+    KUNIT_EXPECT_MEMEQ(test, cmd, clear, len);
+
+    len = seven_segment_encode_update(&fb, 0, false, cmd);
+    KUNIT_EXPECT_EQ(test, len, 0);
+}
+
+static void seven_segment_test_encode_segments(struct kunit *test){
+    struct seven_segment_frame fb = { .cells = { 0x3f, 0x06, 0x5b, 0x4f }, .chars = 0, .decimals = 0x21, .brightness = 50 };
+    const char expected[] = { SEVENSEGMENT_DIGIT_1, 0x3f, SEVENSEGMENT_DIGIT_1 + 3, 0x4f,
+                              SEVENSEGMENT_DECIMAL_CTRL, 0x21, SEVENSEGMENT_BRIGHTNESS, 50 };
+    char cmd[SEVENSEGMENT_FRAME_MAX];
+    size_t len;
+
+    len = seven_segment_encode_update(&fb, SEVENSEGMENT_DIRTY_CELL(0) | SEVENSEGMENT_DIRTY_CELL(3) |
+                                      SEVENSEGMENT_DIRTY_DECIMALS | SEVENSEGMENT_DIRTY_BRIGHTNESS, false, cmd);
+    KUNIT_ASSERT_EQ(test, len, sizeof(expected));
+    KUNIT_EXPECT_MEMEQ(test, cmd, expected, len);
+}
+
+// Every combination of dirty fields and cell types has to fit the command buffers
+static void seven_segment_test_encode_max(struct kunit *test){
+    struct seven_segment_frame fb = { .cells = "8888", .decimals = 63, .brightness = 100 };
+    char cmd[SEVENSEGMENT_FRAME_MAX + 16];
+    unsigned long dirty;
+    unsigned int chars;
+    size_t len, longest = 0;
+
+    for (chars = 0; chars <= SEVENSEGMENT_DIRTY_CELLS; ++chars){
+        fb.chars = chars;
+        for (dirty = 0; dirty <= SEVENSEGMENT_DIRTY_FRAME; ++dirty){
+            len = seven_segment_encode_update(&fb, dirty, true, cmd);
+            longest = max(longest, len);
+        }
+    }
+    KUNIT_EXPECT_LE(test, longest, SEVENSEGMENT_FRAME_MAX);
+}
+
+static void seven_segment_test_parse_fixed(struct kunit *test){
+    static const struct {
+        const char *text;
+        unsigned int precision;
+        bool neg;
+        u64 val;
+    } cases[] = {
+        { "12.5", 1, false, 125 },
+        { "12.54", 1, false, 125 },
+        { "12.55", 1, false, 126 },     // half up
+        { "+3", 2, false, 300 },
+        { "-0.5", 0, true, 1 },
+        { "-.25", 2, true, 25 },
+        { "007", 0, false, 7 },
+        { "99999999999", 0, false, SEVENSEGMENT_NUMBER_LIMIT },
+    };
+    static const char * const invalid[] = { "", "-", ".", "1.2.3", "abc", "1e3", "12 " };
+    bool neg;
+    u64 val;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(cases); ++i){
+        KUNIT_EXPECT_EQ_MSG(test, seven_segment_parse_fixed(cases[i].text, cases[i].precision, &neg, &val), 0, "%s", cases[i].text);
+        KUNIT_EXPECT_EQ_MSG(test, neg, cases[i].neg, "%s", cases[i].text);
+        KUNIT_EXPECT_EQ_MSG(test, val, cases[i].val, "%s", cases[i].text);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(invalid); ++i)
+        KUNIT_EXPECT_EQ_MSG(test, seven_segment_parse_fixed(invalid[i], 0, &neg, &val), -EINVAL, "\"%s\"", invalid[i]);
+}
+
+static void seven_segment_test_render_number(struct kunit *test){
+    static const struct {
+        const char *value;
+        struct seven_segment_number opts;
+        const char *cells;
+        u8 points;
+    } cases[] = {
+        { "12.5", { .precision = 1 }, " 125", BIT(2) },
+        { "-3.25", { .precision = 2 }, "-325", BIT(1) },
+        { "7", { .left = true }, "7   ", 0 },
+        { "-7", { .left = true }, "-7  ", 0 },
+        { "42", { .zeros = true }, "0042", 0 },
+        { "-42", { .zeros = true }, "-042", 0 },
+        { "-0.001", { .precision = 2 }, " 000", BIT(1) },    // no "-0"
+        { "123.45", { .precision = 2 }, "1235", BIT(2) },    // a fractional digit is dropped to fit
+        { "-14.449", { .precision = 3 }, "-144", BIT(2) },  // two are dropped, rounded only once
+        { "12345", { .precision = 0 }, "----", 0 },
+    };
+    struct seven_segment_number error = { .overflow = SEVENSEGMENT_OVERFLOW_ERROR };
+    char cells[SEVENSEGMENT_DIGITS];
+    u8 points;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(cases); ++i){
+        KUNIT_ASSERT_EQ_MSG(test, seven_segment_render_number(cases[i].value, &cases[i].opts, cells, &points), 0, "%s", cases[i].value);
+        KUNIT_EXPECT_MEMEQ_MSG(test, cells, cases[i].cells, SEVENSEGMENT_DIGITS, "%s", cases[i].value);
+        KUNIT_EXPECT_EQ_MSG(test, points, cases[i].points, "%s", cases[i].value);
+    }
+
+    KUNIT_EXPECT_EQ(test, seven_segment_render_number("12345", &error, cells, &points), -ERANGE);
+    KUNIT_EXPECT_EQ(test, seven_segment_render_number("1,5", &error, cells, &points), -EINVAL);
+}
+
+// Pads with blanks, sends only the digits that changed, strips the newline of echo
+static void seven_segment_test_text(struct kunit *test){
+    static const char all[] = { SEVENSEGMENT_CURSOR_CTRL, 0, '1', '2', ' ', ' ' };
+    static const char second[] = { SEVENSEGMENT_CURSOR_CTRL, 1, '3' };
+    static const char back[] = { SEVENSEGMENT_CURSOR_CTRL, 1, '2' };
+    static const struct seven_segment_test_write_case cases[] = {
+        { "12", all, sizeof(all) },
+        { "13", second, sizeof(second) },
+        { "12\n", back, sizeof(back) },
+        { "12", NULL, 0 },
+    };
+    static const char * const invalid[] = { "12345", "1v", "\x81" };
+
+    seven_segment_test_writes(test, SEVENSEGMENT_TEXT_FILE, cases, ARRAY_SIZE(cases), invalid, ARRAY_SIZE(invalid));
+}
+
+static void seven_segment_test_custom_digit(struct kunit *test){
+    static const char first[] = { SEVENSEGMENT_DIGIT_1 + 2, 127 };
+    static const char zero[] = { SEVENSEGMENT_DIGIT_1 + 2, 0 };
+    static const struct seven_segment_test_write_case cases[] = {
+        { "127", first, sizeof(first) },
+        { "0\n", zero, sizeof(zero) },
+        { "0", NULL, 0 },
+    };
+    static const char * const invalid[] = { "128", "-1", "x" };
+
+    seven_segment_test_writes(test, SEVENSEGMENT_CUSTOM_DIGIT3_FILE, cases, ARRAY_SIZE(cases), invalid, ARRAY_SIZE(invalid));
+}
+
+static void seven_segment_test_decimals(struct kunit *test){
+    static const char first[] = { SEVENSEGMENT_DECIMAL_CTRL, 5 };
+    static const char colon[] = { SEVENSEGMENT_DECIMAL_CTRL, SEVENSEGMENT_DECIMAL_COLON };
+    static const struct seven_segment_test_write_case cases[] = {
+        { "5", first, sizeof(first) },
+        { "16\n", colon, sizeof(colon) },
+        { "16", NULL, 0 },
+    };
+    static const char * const invalid[] = { "64", "-1", "0x10" };
+
+    seven_segment_test_writes(test, SEVENSEGMENT_DECIMALS_FILE, cases, ARRAY_SIZE(cases), invalid, ARRAY_SIZE(invalid));
+}
+
+static void seven_segment_test_brightness(struct kunit *test){
+    static const char first[] = { SEVENSEGMENT_BRIGHTNESS, 50 };
+    static const char off[] = { SEVENSEGMENT_BRIGHTNESS, 0 };
+    static const struct seven_segment_test_write_case cases[] = {
+        { "50", first, sizeof(first) },
+        { "0\n", off, sizeof(off) },
+        { "0", NULL, 0 },
+    };
+    static const char * const invalid[] = { "101", "-1", "bright" };
+
+    seven_segment_test_writes(test, SEVENSEGMENT_BRIGHTNESS_FILE, cases, ARRAY_SIZE(cases), invalid, ARRAY_SIZE(invalid));
+}
+
+// Only what changed since the last update goes to the transport
+static void seven_segment_test_commit_updates(struct kunit *test){
+    struct seven_segment_test_display *td = test->priv;
+    const char text[] = { SEVENSEGMENT_CURSOR_CTRL, 0, '1', '2', '3', '4' };
+    const char digit[] = { SEVENSEGMENT_CURSOR_CTRL, 2, '4' };
+    const char custom[] = { SEVENSEGMENT_DIGIT_1, 127, SEVENSEGMENT_BRIGHTNESS, 50 };
+    const char quoted[] = { SEVENSEGMENT_CURSOR_CTRL, 0, '1', ' ', '2', ' ' };
+
+    KUNIT_ASSERT_GT(test, seven_segment_test_commit(td, "text=1234"), 0);
+    KUNIT_ASSERT_EQ(test, td->len, sizeof(text));
+    KUNIT_EXPECT_MEMEQ(test, td->sent, text, td->len);
+
+    KUNIT_ASSERT_GT(test, seven_segment_test_commit(td, "text=1244"), 0);
+    KUNIT_ASSERT_EQ(test, td->len, sizeof(digit));
+    KUNIT_EXPECT_MEMEQ(test, td->sent, digit, td->len);
+
+    KUNIT_ASSERT_GT(test, seven_segment_test_commit(td, "text=1244"), 0);
+    KUNIT_EXPECT_EQ(test, td->transfers, 0);
+
+    KUNIT_ASSERT_GT(test, seven_segment_test_commit(td, "custom_digit1=127 brightness=50"), 0);
+    KUNIT_ASSERT_EQ(test, td->len, sizeof(custom));
+    KUNIT_EXPECT_MEMEQ(test, td->sent, custom, td->len);
+    KUNIT_EXPECT_EQ(test, td->transfers, 1);
+
+    KUNIT_ASSERT_GT(test, seven_segment_test_commit(td, "text=\"1 2\""), 0);
+    KUNIT_ASSERT_EQ(test, td->len, sizeof(quoted));
+    KUNIT_EXPECT_MEMEQ(test, td->sent, quoted, td->len);
+}
+
+// An invalid field rejects the whole commit, nothing is sent
+static void seven_segment_test_commit_invalid(struct kunit *test){
+    struct seven_segment_test_display *td = test->priv;
+    static const char * const invalid[] = {
+        "text=12345",
+        "text=1v",                  // 'v' is the clear command
+        "decimals=64",
+        "brightness=101",
+        "custom_digit5=1",
+        "custom_digit1=128",
+        "urgent=2",
+        "text=\"12",
+        "text",
+        "blink=1",
+    };
+    int i;
+
+    KUNIT_ASSERT_GT(test, seven_segment_test_commit(td, "text=1234"), 0);
+    for (i = 0; i < ARRAY_SIZE(invalid); ++i){
+        KUNIT_EXPECT_EQ_MSG(test, seven_segment_test_commit(td, invalid[i]), -EINVAL, "%s", invalid[i]);
+        KUNIT_EXPECT_EQ_MSG(test, td->transfers, 0, "%s", invalid[i]);
+    }
+}
+
+static void seven_segment_bench_encode(struct kunit *test){
+    struct seven_segment_frame fb = { .cells = "1234", .chars = BIT(0) | BIT(2), .decimals = 5, .brightness = 80 };
+    char cmd[SEVENSEGMENT_FRAME_MAX];
+    size_t bytes = 0;
+    u64 start, ns;
+    int i;
+
+    start = ktime_get_ns();
+    for (i = 0; i < SEVENSEGMENT_TEST_BENCH_LOOPS; ++i){
+        bytes += seven_segment_encode_update(&fb, SEVENSEGMENT_DIRTY_FRAME, i & 1, cmd);
+        barrier();
+    }
+    ns = ktime_get_ns() - start;
+
+    kunit_info(test, "encode_update, full frame: %llu ns/op, %zu bytes/op\n",
+               div_u64(ns, SEVENSEGMENT_TEST_BENCH_LOOPS), bytes / SEVENSEGMENT_TEST_BENCH_LOOPS);
+    KUNIT_EXPECT_GT(test, bytes, 0);
+}
+
+// A counter through the whole commit, flush and bus path: the cost of an update, and how many bytes
+// it takes on the wire compared to a full frame
+static void seven_segment_bench_counter(struct kunit *test){
+    struct seven_segment_test_display *td = test->priv;
+    char text[32];
+    size_t bytes = 0;
+    u64 start, ns;
+    int i;
+
+    start = ktime_get_ns();
+    for (i = 0; i < SEVENSEGMENT_TEST_BENCH_UPDATES; ++i){
+        snprintf(text, sizeof(text), "text=\"%4d\"", i);
+        KUNIT_ASSERT_GT(test, seven_segment_test_commit(td, text), 0);
+        bytes += td->len;
+    }
+    ns = ktime_get_ns() - start;
+
+    kunit_info(test, "counter, commit to bus: %llu ns/update, %zu.%02zu bytes/update, full frame: %d bytes\n",
+               div_u64(ns, SEVENSEGMENT_TEST_BENCH_UPDATES), bytes / SEVENSEGMENT_TEST_BENCH_UPDATES,
+               bytes % SEVENSEGMENT_TEST_BENCH_UPDATES / (SEVENSEGMENT_TEST_BENCH_UPDATES / 100), 2 + SEVENSEGMENT_DIGITS);
+    KUNIT_EXPECT_LT(test, bytes, SEVENSEGMENT_TEST_BENCH_UPDATES * (2 + SEVENSEGMENT_DIGITS));
+}
+
+// Each write type through the whole file, flush and bus path, with a value that changes every time
+static void seven_segment_bench_writes(struct kunit *test){
+    static const struct {
+        const char *name;
+        enum SevenSegmentProcFile file;
+        int width;
+        int values;
+    } writes[] = {
+        { "brightness", SEVENSEGMENT_BRIGHTNESS_FILE, 0, 101 },
+        { "decimals", SEVENSEGMENT_DECIMALS_FILE, 0, 64 },
+        { "custom_digit1", SEVENSEGMENT_CUSTOM_DIGIT1_FILE, 0, 128 },
+        { "text", SEVENSEGMENT_TEXT_FILE, SEVENSEGMENT_DIGITS, 10000 },
+    };
+    struct seven_segment_test_display *td = test->priv;
+    char text[16];
+    size_t bytes;
+    u64 start, ns;
+    int i, j;
+
+    for (j = 0; j < ARRAY_SIZE(writes); ++j){
+        bytes = 0;
+        start = ktime_get_ns();
+        for (i = 0; i < SEVENSEGMENT_TEST_BENCH_UPDATES; ++i){
+            snprintf(text, sizeof(text), "%*d", writes[j].width, i % writes[j].values);
+            KUNIT_ASSERT_GT(test, seven_segment_test_write(td, writes[j].file, text), 0);
+            bytes += td->len;
+        }
+        ns = ktime_get_ns() - start;
+
+        kunit_info(test, "%s, write to bus: %llu ns/update, %zu.%02zu bytes/update\n", writes[j].name,
+                   div_u64(ns, SEVENSEGMENT_TEST_BENCH_UPDATES), bytes / SEVENSEGMENT_TEST_BENCH_UPDATES,
+                   bytes % SEVENSEGMENT_TEST_BENCH_UPDATES / (SEVENSEGMENT_TEST_BENCH_UPDATES / 100));
+        KUNIT_EXPECT_GT(test, bytes, 0);
+    }
+}
+
+static struct kunit_case seven_segment_test_cases[] = {
+    KUNIT_CASE(seven_segment_test_encode_chars),
+    KUNIT_CASE(seven_segment_test_encode_segments),
+    KUNIT_CASE(seven_segment_test_encode_max),
+    KUNIT_CASE(seven_segment_test_parse_fixed),
+    KUNIT_CASE(seven_segment_test_render_number),
+    KUNIT_CASE(seven_segment_test_text),
+    KUNIT_CASE(seven_segment_test_custom_digit),
+    KUNIT_CASE(seven_segment_test_decimals),
+    KUNIT_CASE(seven_segment_test_brightness),
+    KUNIT_CASE(seven_segment_test_commit_updates),
+    KUNIT_CASE(seven_segment_test_commit_invalid),
+    KUNIT_CASE(seven_segment_bench_encode),
+    KUNIT_CASE(seven_segment_bench_counter),
+    KUNIT_CASE(seven_segment_bench_writes),
+    {}
+};
+
+static struct kunit_suite seven_segment_test_suite = {
+    .name = "ssd-core",
+    .init = seven_segment_test_init,
+    .exit = seven_segment_test_exit,
+    .test_cases = seven_segment_test_cases,
+};
+
+kunit_test_suite(seven_segment_test_suite);
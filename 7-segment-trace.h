@@ -0,0 +1,43 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ssd
+
+#if !defined(SEVENSEGMENT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define SEVENSEGMENT_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// One command burst sent to a display. For spi the duration covers the time from submitting the
+// message until its completion.
+TRACE_EVENT(ssd_send_cmd,
+    TP_PROTO(int idx, u8 cmd, size_t len, int ret, u64 duration_ns),
+
+    TP_ARGS(idx, cmd, len, ret, duration_ns),
+
+    TP_STRUCT__entry(
+        __field(int, idx)
+        __field(u8, cmd)
+        __field(size_t, len)
+        __field(int, ret)
+        __field(u64, duration_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->idx = idx;
+        __entry->cmd = cmd;
+        __entry->len = len;
+        __entry->ret = ret;
+        __entry->duration_ns = duration_ns;
+    ),
+
+    TP_printk("ssd%d cmd=0x%02x len=%zu ret=%d duration=%lluns",
+              __entry->idx, __entry->cmd, __entry->len, __entry->ret, __entry->duration_ns)
+);
+
+#endif // SEVENSEGMENT_TRACE_H
+
+// the Makefile adds the source directory to the include path
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE 7-segment-trace
+#include <trace/define_trace.h>
@@ -0,0 +1,289 @@
+#include <linux/fs.h>
+#include <linux/init.h>
+#include <linux/module.h>
+
+#include <linux/platform_device.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/delay.h>
+#include <linux/slab.h>
+
+#include "7-segment.h"
+
+// Displays without hardware: the command stream is decoded into an emulated panel, which can be
+// inspected in debugfs. Meant for testing and benchmarking the driver and its users.
+
+#define SEVENSEGMENT_VIRTUAL_MAX_BUSES  16
+
+static unsigned int displays = 1;
+module_param(displays, uint, 0444);
+MODULE_PARM_DESC(displays, "Number of virtual displays to create");
+
+static unsigned int buses = 1;
+module_param(buses, uint, 0444);
+MODULE_PARM_DESC(buses, "Number of virtual buses the displays are spread over");
+
+static unsigned int latency_us;
+module_param(latency_us, uint, 0444);
+MODULE_PARM_DESC(latency_us, "Initial simulated bus latency per transfer, in microseconds");
+
+// only the addresses are used, to tell the buses apart
+static char seven_segment_virtual_buses[SEVENSEGMENT_VIRTUAL_MAX_BUSES];
+static struct platform_device **seven_segment_virtual_devices;
+
+struct seven_segment_virtual {
+    struct seven_segment_display ssd;   // must come first, the core frees it
+    spinlock_t lock;                    // protects the emulated panel
+    struct seven_segment_frame panel;
+    int cursor;
+    u8 pending;                         // command waiting for its argument, 0 if none
+    u64 bytes;
+    u32 latency_us;                     // slept after every transfer
+};
+
+static struct seven_segment_virtual *seven_segment_to_virtual(struct seven_segment_display *ssd){
+    return container_of(ssd, struct seven_segment_virtual, ssd);
+}
+
+static void seven_segment_virtual_clear(struct seven_segment_virtual *vd){
+    int i;
+
+    for (i = 0; i < SEVENSEGMENT_DIGITS; ++i)
+        vd->panel.cells[i] = ' ';
+    vd->panel.chars = SEVENSEGMENT_DIRTY_CELLS;
+    vd->panel.decimals = 0;
+    vd->cursor = 0;
+}
+
+// Feeds one byte to the emulated panel, the same way the display's firmware interprets it.
+static void seven_segment_virtual_decode(struct seven_segment_virtual *vd, u8 c){
+    u8 cmd = vd->pending;
+
+    vd->pending = 0;
+    switch (cmd){
+    case SEVENSEGMENT_DECIMAL_CTRL:
+        vd->panel.decimals = c;
+        return;
+    case SEVENSEGMENT_CURSOR_CTRL:
+        vd->cursor = c % SEVENSEGMENT_DIGITS;
+        return;
+    case SEVENSEGMENT_BRIGHTNESS:
+        vd->panel.brightness = c;
+        return;
+    case SEVENSEGMENT_DIGIT_1 ... SEVENSEGMENT_DIGIT_4:
+        vd->panel.cells[cmd - SEVENSEGMENT_DIGIT_1] = c;
+        vd->panel.chars &= ~BIT(cmd - SEVENSEGMENT_DIGIT_1);
+        return;
+    }
+
+    switch (c){
+    case SEVENSEGMENT_CLEAR_SCREEN:
+        seven_segment_virtual_clear(vd);
+        break;
+    case SEVENSEGMENT_FACTORY_RESET:
+        seven_segment_virtual_clear(vd);
+        vd->panel.brightness = 100;
+        break;
+    case SEVENSEGMENT_DECIMAL_CTRL:
+    case SEVENSEGMENT_CURSOR_CTRL:
+    case SEVENSEGMENT_BRIGHTNESS:
+    case SEVENSEGMENT_DIGIT_1 ... SEVENSEGMENT_DIGIT_4:
+        vd->pending = c;
+        break;
+    default:
+        vd->panel.cells[vd->cursor] = c;
+        vd->panel.chars |= BIT(vd->cursor);
+        vd->cursor = (vd->cursor + 1) % SEVENSEGMENT_DIGITS;
+    }
+}
+
+static int seven_segment_virtual_send(struct seven_segment_display *ssd, char *cmd, size_t len, unsigned long sent){
+    struct seven_segment_virtual *vd = seven_segment_to_virtual(ssd);
+    u32 delay = READ_ONCE(vd->latency_us);
+    size_t i;
+
+    spin_lock_irq(&vd->lock);
+    for (i = 0; i < len; ++i)
+        seven_segment_virtual_decode(vd, cmd[i]);
+    vd->bytes += len;
+    spin_unlock_irq(&vd->lock);
+
+    // the bus is held for the whole transfer, like a real one would be
+    if (delay)
+        fsleep(delay);
+    return len;
+}
+
+static void *seven_segment_virtual_bus_adapter(struct seven_segment_display *ssd){
+    return &seven_segment_virtual_buses[ssd->device.pdev->id % buses];
+}
+
+static void seven_segment_virtual_bus_name(struct seven_segment_display *ssd, char *name, size_t sz){
+    snprintf(name, sz, "virtual%d", ssd->device.pdev->id % buses);
+}
+
+static const char *seven_segment_virtual_name(struct seven_segment_display *ssd){
+    return dev_name(&ssd->device.pdev->dev);
+}
+
+static struct device *seven_segment_virtual_dev(struct seven_segment_display *ssd){
+    return &ssd->device.pdev->dev;
+}
+
+static int seven_segment_virtual_panel_show(struct seq_file *m, void *v){
+    struct seven_segment_virtual *vd = m->private;
+    struct seven_segment_frame panel;
+    int i, cursor;
+    u64 bytes;
+
+    spin_lock_irq(&vd->lock);
+    panel = vd->panel;
+    cursor = vd->cursor;
+    bytes = vd->bytes;
+    spin_unlock_irq(&vd->lock);
+
+    seq_puts(m, "digits:");
+    for (i = 0; i < SEVENSEGMENT_DIGITS; ++i){
+        if (panel.chars & BIT(i))
+            seq_printf(m, " '%c'", panel.cells[i]);
+        else
+            seq_printf(m, " 0x%02x", panel.cells[i]);
+    }
+    seq_printf(m, "\ndecimals: 0x%02x\n", panel.decimals);
+    seq_printf(m, "brightness: %d\n", panel.brightness);
+    seq_printf(m, "cursor: %d\n", cursor);
+    seq_printf(m, "bytes: %llu\n", bytes);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(seven_segment_virtual_panel);
+
+static void seven_segment_virtual_debugfs(struct seven_segment_display *ssd){
+    struct seven_segment_virtual *vd = seven_segment_to_virtual(ssd);
+
+    debugfs_create_file("panel", 0444, ssd->debugfs, vd, &seven_segment_virtual_panel_fops);
+    debugfs_create_u32("latency_us", 0644, ssd->debugfs, &vd->latency_us);
+}
+
+static const struct seven_segment_transport seven_segment_virtual_transport = {
+    .type = SEVENSEGMENT_VIRTUAL,
+    .send = seven_segment_virtual_send,
+    .bus_adapter = seven_segment_virtual_bus_adapter,
+    .bus_name = seven_segment_virtual_bus_name,
+    .name = seven_segment_virtual_name,
+    .dev = seven_segment_virtual_dev,
+    .debugfs = seven_segment_virtual_debugfs,
+};
+
+static int seven_segment_probe(struct platform_device *pdev){
+    int ret;
+    struct seven_segment_virtual *vd;
+
+    // the core frees the display once its last user is gone
+    BUILD_BUG_ON(offsetof(struct seven_segment_virtual, ssd) != 0);
+
+    vd = kzalloc(sizeof(struct seven_segment_virtual), GFP_KERNEL);
+    if (!vd)
+        return -ENOMEM;
+
+    ret = seven_segment_init_display(&vd->ssd);
+    if (ret){
+        kfree(vd);
+        return ret;
+    }
+
+    // the panel powers up blank, but its state is unknown to the driver all the same
+    spin_lock_init(&vd->lock);
+    seven_segment_virtual_clear(vd);
+    vd->panel.brightness = 100;
+    vd->latency_us = latency_us;
+
+    vd->ssd.device.pdev = pdev;
+    vd->ssd.transport = &seven_segment_virtual_transport;
+
+    ret = seven_segment_register_display(&vd->ssd);
+    if (ret){
+        seven_segment_release_display(&vd->ssd);
+        seven_segment_put_display(&vd->ssd);
+        return ret;
+    }
+
+    platform_set_drvdata(pdev, vd);
+
+    return 0;
+}
+
+static void seven_segment_remove(struct platform_device *pdev){
+    struct seven_segment_virtual *vd;
+    vd = platform_get_drvdata(pdev);
+    seven_segment_unregister_display(&vd->ssd);
+    seven_segment_release_display(&vd->ssd);
+    seven_segment_put_display(&vd->ssd);
+}
+
+static struct platform_driver seven_segment_virtual_driver = {
+    .probe = seven_segment_probe,
+    .remove = seven_segment_remove,
+    .driver = {
+        .name = "ssd-virtual",
+        .owner = THIS_MODULE,
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS
+    }
+};
+
+static void seven_segment_virtual_remove_devices(void){
+    unsigned int i;
+
+    for (i = 0; i < displays; ++i){
+        if (!IS_ERR_OR_NULL(seven_segment_virtual_devices[i]))
+            platform_device_unregister(seven_segment_virtual_devices[i]);
+    }
+    kfree(seven_segment_virtual_devices);
+}
+
+static int __init seven_segment_init(void){
+    unsigned int i;
+    int ret;
+
+    if (!buses || buses > SEVENSEGMENT_VIRTUAL_MAX_BUSES){
+        pr_err("buses must be between 1 and %d\n", SEVENSEGMENT_VIRTUAL_MAX_BUSES);
+        return -EINVAL;
+    }
+
+    seven_segment_virtual_devices = kcalloc(displays, sizeof(*seven_segment_virtual_devices), GFP_KERNEL);
+    if (!seven_segment_virtual_devices)
+        return -ENOMEM;
+
+    ret = platform_driver_register(&seven_segment_virtual_driver);
+    if (ret){
+        pr_err("Failed to register virtual driver: %d\n", ret);
+        goto err_free;
+    }
+
+    for (i = 0; i < displays; ++i){
+        seven_segment_virtual_devices[i] = platform_device_register_simple("ssd-virtual", i, NULL, 0);
+        if (IS_ERR(seven_segment_virtual_devices[i])){
+            ret = PTR_ERR(seven_segment_virtual_devices[i]);
+            pr_err("Failed to create virtual display %u: %d\n", i, ret);
+            goto err_devices;
+        }
+    }
+    return 0;
+
+err_devices:
+    seven_segment_virtual_remove_devices();
+    platform_driver_unregister(&seven_segment_virtual_driver);
+    return ret;
+err_free:
+    kfree(seven_segment_virtual_devices);
+    return ret;
+}
+
+static void __exit seven_segment_exit(void){
+    seven_segment_virtual_remove_devices();
+    platform_driver_unregister(&seven_segment_virtual_driver);
+}
+
+module_init(seven_segment_init);
+module_exit(seven_segment_exit);
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Gyorgy Sarvari");
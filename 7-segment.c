@@ -1,63 +1,813 @@
+#include <linux/module.h>
 #include <linux/string.h>
+#include <linux/ctype.h>
 #include <linux/proc_fs.h>
-#include <linux/i2c.h>
-#include <linux/spi/spi.h>
+#include <linux/workqueue.h>
+#include <linux/miscdevice.h>
+#include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/idr.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/sort.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/time.h>
+#include <linux/timekeeping.h>
+#include <linux/slab.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/poll.h>
+#include <linux/thermal.h>
+#include <linux/iio/consumer.h>
 #include "7-segment.h"
+#include "7-segment-ioctl.h"
 
-struct proc_dir_entry *procparent;
+#define CREATE_TRACE_POINTS
+#include "7-segment-trace.h"
 
-static int seven_segment_send_cmd(struct seven_segment_display *ssd, char* cmd, size_t len) {
+static struct proc_dir_entry *procparent;
+
+static DEFINE_IDR(seven_segment_idr);
+static LIST_HEAD(seven_segment_buses);
+static LIST_HEAD(seven_segment_groups);
+static struct proc_dir_entry *groupsparent;
+static struct proc_dir_entry *busesparent;
+static struct proc_dir_entry *statefile;
+static struct dentry *debugfsparent;
+// protects the idr, the bus and group lists, and group membership
+static DEFINE_MUTEX(seven_segment_registry_lock);
+
+static void seven_segment_update_recovered(struct seven_segment_display *ssd);
+
+// Records a finished command burst in the trace and the statistics, a successful one also ends
+// the failure state of the display. Safe in any context.
+void seven_segment_account(struct seven_segment_display *ssd, const void *cmd, size_t len, int ret, u64 start){
+    u64 ns = ktime_get_ns() - start;
+    u64 us = div_u64(ns, NSEC_PER_USEC);
+    int bucket = us ? min_t(int, ilog2(us) + 1, SEVENSEGMENT_LATENCY_BUCKETS - 1) : 0;
+
+    trace_ssd_send_cmd(ssd->idx, *(const u8 *)cmd, len, ret, ns);
+
+    this_cpu_inc(ssd->stats->commands);
+    if (ret < 0)
+        this_cpu_inc(ssd->stats->errors);
+    else
+        this_cpu_add(ssd->stats->bytes, len);
+    this_cpu_inc(ssd->stats->latency[bucket]);
+
+    if (ret >= 0 && READ_ONCE(ssd->failures))
+        seven_segment_update_recovered(ssd);
+}
+
+EXPORT_SYMBOL(seven_segment_account);
+
+// sent: SEVENSEGMENT_DIRTY_* bits carried by cmd, to be resent if the update fails
+static int seven_segment_send_cmd(struct seven_segment_display *ssd, char* cmd, size_t len, unsigned long sent) {
+    u64 start = ktime_get_ns();
     int ret;
-    switch (ssd->device_type){
-    case SEVENSEGMENT_I2C:
-        ret = i2c_master_send(ssd->device.i2c, cmd, len);
-        break;
-    case SEVENSEGMENT_SPI:
-    default:
-        ret = spi_write(ssd->device.spi, cmd, len);
-        break;
-    }
 
+    ret = ssd->transport->send(ssd, cmd, len, sent);
+    // async transports account on completion, unless it couldn't even be submitted
+    if (!ssd->transport->async || ret < 0)
+        seven_segment_account(ssd, cmd, len, ret, start);
+
+    // cmd is binary, not a string. A display that dropped off the bus fails every update, don't flood the log
     if (ret < 0)
-        pr_err("Could not send cmd \'%s\'. Error: %d\n", cmd, ret);
+        pr_err_ratelimited("ssd%d: could not send %zu bytes, starting with 0x%02x. Error: %d\n", ssd->idx, len, (u8)cmd[0], ret);
     return ret;
 }
 
-static void seven_segment_reset_screen(struct seven_segment_display* client){
-    char cmd[] = {SEVENSEGMENT_CLEAR_SCREEN};
-    seven_segment_send_cmd(client, cmd, 1);
+static unsigned long seven_segment_frame_diff(struct seven_segment_display *ssd){
+    unsigned long diff = 0;
+    int i;
+
+    for (i = 0; i < SEVENSEGMENT_DIGITS; ++i){
+        if (ssd->fb.cells[i] != ssd->shadow.cells[i] || ((ssd->fb.chars ^ ssd->shadow.chars) & BIT(i)))
+            diff |= SEVENSEGMENT_DIRTY_CELL(i);
+    }
+    if (ssd->fb.decimals != ssd->shadow.decimals)
+        diff |= SEVENSEGMENT_DIRTY_DECIMALS;
+    if (ssd->fb.brightness != ssd->shadow.brightness)
+        diff |= SEVENSEGMENT_DIRTY_BRIGHTNESS;
+
+    // whatever the panel shows before we have set it is unknown, so it's never "unchanged"
+    return diff | (~ssd->synced & SEVENSEGMENT_DIRTY_FRAME);
+}
+
+// Recalculates the dirty bits of the fields in mask, after they were modified in the framebuffer
+static void seven_segment_update_dirty(struct seven_segment_display *ssd, unsigned long mask){
+    ssd->dirty = (ssd->dirty & ~mask) | (seven_segment_frame_diff(ssd) & mask);
+}
+
+// Mirrors the framebuffer to the shared page, so mappers and readers see the current state.
+// Call with ssd->lock held.
+static void seven_segment_publish(struct seven_segment_display *ssd){
+    struct ssd_frame frame;
+    bool changed;
+
+    memcpy(frame.segments, ssd->fb.cells, SEVENSEGMENT_DIGITS);
+    frame.decimals = ssd->fb.decimals;
+    frame.brightness = ssd->fb.brightness;
+    frame.flags = ssd->fb.chars & SSD_FRAME_CHARS;
+    frame.reserved = 0;
+    changed = memcmp(&frame, &ssd->state, sizeof(frame));
+
+    if (changed){
+        write_seqcount_begin(&ssd->state_seq);
+        ssd->state = frame;
+        ++ssd->generation;
+        write_seqcount_end(&ssd->state_seq);
+    }
+
+    // The shared page is restored even without a change. Like userspace, the kernel makes seq odd while
+    // it writes the frame. If seq moved since the kernel last wrote it, a mapper is writing, or wrote a frame
+    // the refresh work didn't pick up yet: that one wins, the refresh work publishes it after applying it.
+    if (cmpxchg(&ssd->shared->seq, ssd->shared_seq, ssd->shared_seq + 1) == ssd->shared_seq){
+        smp_wmb();
+        memcpy(&ssd->shared->frame, &frame, sizeof(frame));
+        ssd->shared_seq += 2;
+        smp_store_release(&ssd->shared->seq, ssd->shared_seq);
+    }
+
+    if (changed)
+        wake_up_interruptible_poll(&ssd->change_wait, EPOLLIN | EPOLLRDNORM);
+}
+
+// Encodes the SEVENSEGMENT_DIRTY_* fields of fb into cmd, preceded by a clear if requested.
+// Depends only on its arguments, so it can be exercised without a display or a bus.
+static size_t seven_segment_encode_update(const struct seven_segment_frame *fb, unsigned long dirty, bool clear, char *cmd){
+    size_t len = 0;
+    int i, cursor = -1;
+
+    if (clear){
+        cmd[len++] = SEVENSEGMENT_CLEAR_SCREEN;
+        cursor = 0;
+    }
+
+    for (i = 0; i < SEVENSEGMENT_DIGITS; ++i){
+        if (!(dirty & SEVENSEGMENT_DIRTY_CELL(i)))
+            continue;
+
+        if (fb->chars & BIT(i)){
+            // the cursor advances after each character, consecutive cells need no repositioning
+            if (cursor != i){
+                cmd[len++] = SEVENSEGMENT_CURSOR_CTRL;
+                cmd[len++] = i;
+            }
+            cmd[len++] = fb->cells[i];
+            cursor = i + 1;
+        } else {
+            cmd[len++] = SEVENSEGMENT_DIGIT_1 + i;
+            cmd[len++] = fb->cells[i];
+        }
+    }
+
+    if (dirty & SEVENSEGMENT_DIRTY_DECIMALS){
+        cmd[len++] = SEVENSEGMENT_DECIMAL_CTRL;
+        cmd[len++] = fb->decimals;
+    }
+
+    if (dirty & SEVENSEGMENT_DIRTY_BRIGHTNESS){
+        cmd[len++] = SEVENSEGMENT_BRIGHTNESS;
+        cmd[len++] = fb->brightness;
+    }
+
+    return len;
+}
+
+// Builds the command sequence for everything that differs between the framebuffer and the panel,
+// and marks it as sent. The sent fields are reported in *sent. Call with ssd->lock held.
+static size_t seven_segment_prepare_update(struct seven_segment_display *ssd, char *cmd, unsigned long *sent){
+    bool clear;
+    size_t len;
+    int i;
+
+    *sent = ssd->dirty;
+    if (!ssd->dirty)
+        return 0;
+
+    clear = ssd->dirty & SEVENSEGMENT_DIRTY_CLEAR;
+    if (clear){
+        // clearing blanks all digits and decimal points, and moves the cursor home
+        for (i = 0; i < SEVENSEGMENT_DIGITS; ++i)
+            ssd->shadow.cells[i] = ' ';
+        ssd->shadow.chars = SEVENSEGMENT_DIRTY_CELLS;
+        ssd->shadow.decimals = 0;
+        ssd->synced |= SEVENSEGMENT_DIRTY_CELLS | SEVENSEGMENT_DIRTY_DECIMALS;
+        ssd->dirty &= ~SEVENSEGMENT_DIRTY_CLEAR;
+        seven_segment_update_dirty(ssd, SEVENSEGMENT_DIRTY_CELLS | SEVENSEGMENT_DIRTY_DECIMALS);
+        *sent |= SEVENSEGMENT_DIRTY_CELLS | SEVENSEGMENT_DIRTY_DECIMALS;
+    }
+
+    len = seven_segment_encode_update(&ssd->fb, ssd->dirty, clear, cmd);
+
+    ssd->shadow = ssd->fb;
+    ssd->synced |= ssd->dirty;
+    ssd->dirty = 0;
+    return len;
+}
+
+static void seven_segment_schedule_flush(struct seven_segment_display *ssd);
+
+// The panel is in an unknown state after a failed transfer, the next update has to resend these fields.
+// It's retried with exponential backoff. After too many failures the display is taken for gone: it may
+// come back power cycled, so then everything is resent, in one burst. Safe in any context.
+void seven_segment_update_failed(struct seven_segment_display *ssd, unsigned long sent){
+    unsigned long flags;
+    unsigned int backoff;
+    bool offline;
+
+    spin_lock_irqsave(&ssd->lock, flags);
+    offline = ssd->health != SEVENSEGMENT_HEALTH_OFFLINE;
+    ++ssd->failures;
+    backoff = SEVENSEGMENT_RETRY_MIN << min(ssd->failures - 1, 16U);
+    backoff = min(backoff, (unsigned int)SEVENSEGMENT_RETRY_MAX);
+    ssd->synced &= ~sent;
+    if (ssd->failures >= SEVENSEGMENT_MAX_RETRIES){
+        // offline displays are retried every SEVENSEGMENT_RETRY_MAX ms
+        ssd->health = SEVENSEGMENT_HEALTH_OFFLINE;
+        ssd->synced = 0;
+        backoff = SEVENSEGMENT_RETRY_MAX;
+    } else {
+        ssd->health = SEVENSEGMENT_HEALTH_RETRYING;
+    }
+    ssd->retry_at = jiffies + msecs_to_jiffies(backoff);
+    // only the transition is reported
+    offline = offline && ssd->health == SEVENSEGMENT_HEALTH_OFFLINE;
+    seven_segment_update_dirty(ssd, SEVENSEGMENT_DIRTY_FRAME);
+    spin_unlock_irqrestore(&ssd->lock, flags);
+
+    if (offline)
+        pr_warn("ssd%d is offline, retrying every %d ms\n", ssd->idx, SEVENSEGMENT_RETRY_MAX);
+
+    // nobody else would flush the failed fields again
+    seven_segment_schedule_flush(ssd);
+}
+
+EXPORT_SYMBOL(seven_segment_update_failed);
+
+static void seven_segment_update_recovered(struct seven_segment_display *ssd){
+    enum SevenSegmentHealth health;
+    unsigned long flags;
+
+    spin_lock_irqsave(&ssd->lock, flags);
+    health = ssd->health;
+    ssd->failures = 0;
+    ssd->health = SEVENSEGMENT_HEALTH_OK;
+    spin_unlock_irqrestore(&ssd->lock, flags);
+
+    if (health == SEVENSEGMENT_HEALTH_OFFLINE)
+        pr_info("ssd%d is back online\n", ssd->idx);
+}
+
+static void seven_segment_bus_enqueue(struct seven_segment_display *ssd);
+
+// The refresh rate allows the display to be updated, take its place in the queue of the bus.
+static void seven_segment_flush_work(struct work_struct *work){
+    struct seven_segment_display *ssd = container_of(to_delayed_work(work), struct seven_segment_display, flush_work);
+    unsigned long retry_at = READ_ONCE(ssd->retry_at), now = jiffies;
+
+    if (READ_ONCE(ssd->dead))
+        return;
+
+    // a failing display waits out its backoff, however the flush was scheduled
+    if (READ_ONCE(ssd->failures) && time_before(now, retry_at)){
+        queue_delayed_work(system_unbound_wq, &ssd->flush_work, retry_at - now);
+        return;
+    }
+    seven_segment_bus_enqueue(ssd);
+}
+
+// Queues a flush, no sooner than the display's refresh rate allows. If one is pending already,
+// it will pick up the new state too.
+static void seven_segment_schedule_flush(struct seven_segment_display *ssd){
+    // jiffies may tick between two reads, next - jiffies would wrap when it passes next
+    unsigned long next, delay = 0, now = jiffies;
+    unsigned int rate = READ_ONCE(ssd->refresh_rate);
+    // priority only goes before the other displays of the bus, otherwise every update would skip the rate
+    bool urgent = READ_ONCE(ssd->urgent);
+
+    // a send failing while the display is released must not re-arm the flush
+    if (READ_ONCE(ssd->dead))
+        return;
+
+    // urgent updates don't wait for the refresh period
+    if (rate && !urgent){
+        next = READ_ONCE(ssd->last_flush) + DIV_ROUND_UP(HZ, rate);
+        if (time_before(now, next))
+            delay = next - now;
+    }
+
+    // but nothing skips the backoff of a failing display
+    if (READ_ONCE(ssd->failures)){
+        next = READ_ONCE(ssd->retry_at);
+        if (time_before(now + delay, next))
+            delay = next - now;
+    }
+
+    // nor for a flush that is already pending with the refresh period's delay
+    if (urgent){
+        if (mod_delayed_work(system_unbound_wq, &ssd->flush_work, delay))
+            this_cpu_inc(ssd->stats->coalesced);
+        return;
+    }
+
+    if (!queue_delayed_work(system_unbound_wq, &ssd->flush_work, delay))
+        this_cpu_inc(ssd->stats->coalesced);
+}
+
+// Adds the bytes and transfers just sent to the bus' budget. Call with bus->lock held.
+static void seven_segment_bus_charge(struct seven_segment_bus *bus, size_t bytes, int transfers){
+    if (bus->max_bytes)
+        bus->byte_budget -= bytes;
+    if (bus->max_transfers)
+        bus->transfer_budget -= transfers;
+}
+
+// Refills the budgets of the bus for the time passed. Returns how many jiffies to wait until
+// the next transfer is allowed, 0 if it can go right away. Call with bus->lock held.
+static unsigned long seven_segment_bus_refill(struct seven_segment_bus *bus){
+    ktime_t now = ktime_get();
+    s64 elapsed = min_t(s64, ktime_to_ns(ktime_sub(now, bus->last_refill)), NSEC_PER_SEC);
+    u64 wait = 0;
+
+    bus->last_refill = now;
+
+    // the budgets may go negative, a transfer is allowed as long as they are positive
+    if (bus->max_bytes){
+        bus->byte_budget = min_t(s64, bus->byte_budget + div_s64(elapsed * bus->max_bytes, NSEC_PER_SEC),
+                                 max_t(s64, bus->max_bytes / 10, SEVENSEGMENT_FRAME_MAX));
+        if (bus->byte_budget <= 0)
+            wait = div_u64((1 - bus->byte_budget) * NSEC_PER_SEC, bus->max_bytes);
+    }
+
+    if (bus->max_transfers){
+        bus->transfer_budget = min_t(s64, bus->transfer_budget + div_s64(elapsed * bus->max_transfers, NSEC_PER_SEC),
+                                     max_t(s64, bus->max_transfers / 10, 1));
+        if (bus->transfer_budget <= 0)
+            wait = max(wait, div_u64((1 - bus->transfer_budget) * NSEC_PER_SEC, bus->max_transfers));
+    }
+
+    return wait ? nsecs_to_jiffies(wait) + 1 : 0;
+}
+
+// Sends the pending update of a display. Call with bus->lock held.
+static void seven_segment_bus_flush_display(struct seven_segment_bus *bus, struct seven_segment_display *ssd){
+    char cmd[SEVENSEGMENT_FRAME_MAX];
+    unsigned long flags, sent;
+    size_t len;
+    int ret;
+
+    spin_lock_irqsave(&ssd->lock, flags);
+    len = seven_segment_prepare_update(ssd, cmd, &sent);
+    ssd->urgent = false;
+    spin_unlock_irqrestore(&ssd->lock, flags);
+
+    if (!len){
+        this_cpu_inc(ssd->stats->skipped);
+        return;
+    }
+
+    ssd->last_flush = jiffies;
+    ret = seven_segment_send_cmd(ssd, cmd, len, sent);
+    if (ret < 0)
+        seven_segment_update_failed(ssd, sent);
+    seven_segment_bus_charge(bus, len, 1);
+}
+
+// Serves the displays waiting on the bus: urgent ones first, the rest round-robin, one update
+// each per turn, without exceeding the bus' budget. Urgent ones wait for it too.
+static void seven_segment_bus_work(struct work_struct *work){
+    struct seven_segment_bus *bus = container_of(to_delayed_work(work), struct seven_segment_bus, work);
+    struct seven_segment_display *ssd;
+    unsigned long delay;
+    bool waiting;
+
+    for (;;){
+        mutex_lock(&bus->lock);
+        delay = seven_segment_bus_refill(bus);
+
+        spin_lock_irq(&bus->queue_lock);
+        ssd = NULL;
+        if (!delay){
+            ssd = list_first_entry_or_null(&bus->urgent, struct seven_segment_display, bus_node);
+            if (!ssd)
+                ssd = list_first_entry_or_null(&bus->queue, struct seven_segment_display, bus_node);
+        }
+        if (ssd)
+            list_del_init(&ssd->bus_node);
+        waiting = !list_empty(&bus->urgent) || !list_empty(&bus->queue);
+        spin_unlock_irq(&bus->queue_lock);
+
+        if (!ssd){
+            mutex_unlock(&bus->lock);
+            // over budget: come back when there is some again
+            if (delay && waiting)
+                queue_delayed_work(system_unbound_wq, &bus->work, delay);
+            return;
+        }
+
+        seven_segment_bus_flush_display(bus, ssd);
+        mutex_unlock(&bus->lock);
+        cond_resched();
+    }
+}
+
+static void seven_segment_bus_enqueue(struct seven_segment_display *ssd){
+    struct seven_segment_bus *bus = ssd->bus;
+    bool urgent = READ_ONCE(ssd->urgent) || READ_ONCE(ssd->priority);
+    unsigned long flags;
+
+    spin_lock_irqsave(&bus->queue_lock, flags);
+    // a flush that was running when the display died must not queue it again
+    if (READ_ONCE(ssd->dead)){
+        spin_unlock_irqrestore(&bus->queue_lock, flags);
+        return;
+    }
+    // an already waiting display keeps its place, unless it's urgent now
+    if (list_empty(&ssd->bus_node))
+        list_add_tail(&ssd->bus_node, urgent ? &bus->urgent : &bus->queue);
+    else if (urgent)
+        list_move_tail(&ssd->bus_node, &bus->urgent);
+    spin_unlock_irqrestore(&bus->queue_lock, flags);
+
+    // a bus work waiting for its budget is left alone, it serves the urgent displays first anyway
+    queue_delayed_work(system_unbound_wq, &bus->work, 0);
+}
+
+static ssize_t seven_segment_bus_limit_write(struct seven_segment_bus *bus, const char __user *buf, size_t sz, unsigned int *limit){
+    unsigned int val;
+    int ret;
+
+    ret = kstrtouint_from_user(buf, sz, 10, &val);
+    if (ret)
+        return ret;
+
+    mutex_lock(&bus->lock);
+    *limit = val;
+    // start from a full budget
+    bus->byte_budget = max_t(s64, bus->max_bytes / 10, SEVENSEGMENT_FRAME_MAX);
+    bus->transfer_budget = max_t(s64, bus->max_transfers / 10, 1);
+    mutex_unlock(&bus->lock);
+
+    queue_delayed_work(system_unbound_wq, &bus->work, 0);
+    return sz;
+}
+
+static int seven_segment_bus_bytes_show(struct seq_file *m, void *v){
+    struct seven_segment_bus *bus = m->private;
+    seq_printf(m, "%u", READ_ONCE(bus->max_bytes));
+    return 0;
+}
+
+static int seven_segment_bus_bytes_open(struct inode *inode, struct file *f){
+    return single_open(f, seven_segment_bus_bytes_show, pde_data(inode));
+}
+
+static ssize_t seven_segment_bus_bytes_write(struct file *f, const char __user *buf, size_t sz, loff_t *off){
+    struct seven_segment_bus *bus = pde_data(file_inode(f));
+    return seven_segment_bus_limit_write(bus, buf, sz, &bus->max_bytes);
 }
 
+static int seven_segment_bus_transfers_show(struct seq_file *m, void *v){
+    struct seven_segment_bus *bus = m->private;
+    seq_printf(m, "%u", READ_ONCE(bus->max_transfers));
+    return 0;
+}
+
+static int seven_segment_bus_transfers_open(struct inode *inode, struct file *f){
+    return single_open(f, seven_segment_bus_transfers_show, pde_data(inode));
+}
+
+static ssize_t seven_segment_bus_transfers_write(struct file *f, const char __user *buf, size_t sz, loff_t *off){
+    struct seven_segment_bus *bus = pde_data(file_inode(f));
+    return seven_segment_bus_limit_write(bus, buf, sz, &bus->max_transfers);
+}
+
+static const struct proc_ops seven_segment_bus_bytes_pops = {
+    .proc_open = seven_segment_bus_bytes_open,
+    .proc_read = seq_read,
+    .proc_write = seven_segment_bus_bytes_write,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release,
+};
+
+static const struct proc_ops seven_segment_bus_transfers_pops = {
+    .proc_open = seven_segment_bus_transfers_open,
+    .proc_read = seq_read,
+    .proc_write = seven_segment_bus_transfers_write,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release,
+};
+
+// Allocates a bus with a single user, without any limits. It's not listed anywhere yet.
+static struct seven_segment_bus *seven_segment_alloc_bus(const struct seven_segment_transport *transport, void *adapter){
+    struct seven_segment_bus *bus = kzalloc(sizeof(*bus), GFP_KERNEL);
+    if (!bus)
+        return NULL;
+
+    bus->adapter = adapter;
+    bus->transport = transport;
+    bus->users = 1;
+    INIT_LIST_HEAD(&bus->node);
+    mutex_init(&bus->lock);
+    spin_lock_init(&bus->queue_lock);
+    INIT_LIST_HEAD(&bus->queue);
+    INIT_LIST_HEAD(&bus->urgent);
+    INIT_DELAYED_WORK(&bus->work, seven_segment_bus_work);
+    bus->last_refill = ktime_get();
+    return bus;
+}
+
+// Finds or creates the bus the display is connected to. Call with seven_segment_registry_lock held.
+static struct seven_segment_bus *seven_segment_get_bus(struct seven_segment_display *ssd){
+    struct seven_segment_bus *bus;
+    void *adapter = ssd->transport->bus_adapter(ssd);
+
+    list_for_each_entry(bus, &seven_segment_buses, node){
+        if (bus->adapter == adapter){
+            ++bus->users;
+            return bus;
+        }
+    }
+
+    bus = seven_segment_alloc_bus(ssd->transport, adapter);
+    if (!bus)
+        return NULL;
+
+    ssd->transport->bus_name(ssd, bus->name, sizeof(bus->name));
+
+    bus->procfolder = proc_mkdir(bus->name, busesparent);
+    if (bus->procfolder){
+        if (!proc_create_data("max_bytes_per_sec", 0664, bus->procfolder, &seven_segment_bus_bytes_pops, bus))
+            pr_err("Could not create max_bytes_per_sec file in procfs!\n");
+        if (!proc_create_data("max_transfers_per_sec", 0664, bus->procfolder, &seven_segment_bus_transfers_pops, bus))
+            pr_err("Could not create max_transfers_per_sec file in procfs!\n");
+    } else {
+        pr_err("Could not create /proc/ssd/buses/%s!\n", bus->name);
+    }
+
+    list_add(&bus->node, &seven_segment_buses);
+    return bus;
+}
+
+// Call with seven_segment_registry_lock held.
+static void seven_segment_put_bus(struct seven_segment_bus *bus){
+    if (--bus->users)
+        return;
+
+    list_del(&bus->node);
+    proc_remove(bus->procfolder);
+    cancel_delayed_work_sync(&bus->work);
+    kfree(bus);
+}
+
+static unsigned long seven_segment_refresh_interval(struct seven_segment_display *ssd){
+    unsigned int rate = READ_ONCE(ssd->refresh_rate);
+    return DIV_ROUND_UP(HZ, rate ? rate : SEVENSEGMENT_DEFAULT_REFRESH_RATE);
+}
+
+static int seven_segment_set_frame(struct seven_segment_display *ssd, const struct ssd_frame *frame);
+static enum hrtimer_restart seven_segment_effect_timer(struct hrtimer *timer);
+static enum hrtimer_restart seven_segment_dimmer_timer(struct hrtimer *timer);
+static void seven_segment_source_work(struct work_struct *work);
+static void seven_segment_source_unbind(struct seven_segment_display *ssd);
+
+// Applies frames written to the mmap-ed page. Runs as long as somebody has it mapped.
+static void seven_segment_refresh_work(struct work_struct *work){
+    struct seven_segment_display *ssd = container_of(to_delayed_work(work), struct seven_segment_display, refresh_work);
+    struct ssd_frame frame;
+    unsigned long flags;
+    u32 seq;
+
+    // a mapping can outlive the display, and its shared page
+    mutex_lock(&ssd->write_lock);
+    if (ssd->dead){
+        mutex_unlock(&ssd->write_lock);
+        return;
+    }
+
+    // an odd seq means a mapper is still writing the frame: take it on the next round
+    seq = smp_load_acquire(&ssd->shared->seq);
+    if (!(seq & 1) && seq != READ_ONCE(ssd->shared_seq)){
+        memcpy(&frame, &ssd->shared->frame, sizeof(frame));
+        smp_rmb();
+        // a mapper not following the protocol may have torn the frame, it is validated all the same
+        if (READ_ONCE(ssd->shared->seq) == seq){
+            // the page is the kernel's again, even if the frame is invalid: it gets restored then
+            spin_lock_irqsave(&ssd->lock, flags);
+            ssd->shared_seq = seq;
+            spin_unlock_irqrestore(&ssd->lock, flags);
+            if (seven_segment_set_frame(ssd, &frame)){
+                spin_lock_irqsave(&ssd->lock, flags);
+                seven_segment_publish(ssd);
+                spin_unlock_irqrestore(&ssd->lock, flags);
+            }
+        }
+    }
+    mutex_unlock(&ssd->write_lock);
+
+    if (atomic_read(&ssd->mappers))
+        queue_delayed_work(system_unbound_wq, &ssd->refresh_work, seven_segment_refresh_interval(ssd));
+}
+
+int seven_segment_init_display(struct seven_segment_display *ssd){
+    struct page *page;
+    int i;
+
+    ssd->stats = alloc_percpu(struct seven_segment_stats);
+    if (!ssd->stats){
+        pr_err("Could not allocate statistics\n");
+        return -ENOMEM;
+    }
+
+    page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+    if (!page){
+        pr_err("Could not allocate shared page\n");
+        free_percpu(ssd->stats);
+        return -ENOMEM;
+    }
+    ssd->shared = page_address(page);
+
+    for (i = 0; i < SEVENSEGMENT_DIGITS; ++i)
+        ssd->fb.cells[i] = ' ';
+    ssd->fb.chars = SEVENSEGMENT_DIRTY_CELLS;
+    ssd->fb.decimals = 0;
+    ssd->fb.brightness = 100;
+    ssd->synced = 0;
+    ssd->dirty = 0;
+    ssd->refresh_rate = SEVENSEGMENT_DEFAULT_REFRESH_RATE;
+    ssd->last_flush = jiffies - HZ;
+    atomic_set(&ssd->mappers, 0);
+    kref_init(&ssd->ref);
+    ssd->dead = false;
+    INIT_LIST_HEAD(&ssd->bus_node);
+    mutex_init(&ssd->write_lock);
+    spin_lock_init(&ssd->lock);
+    seqcount_spinlock_init(&ssd->state_seq, &ssd->lock);
+    init_waitqueue_head(&ssd->change_wait);
+    INIT_DELAYED_WORK(&ssd->flush_work, seven_segment_flush_work);
+    INIT_DELAYED_WORK(&ssd->refresh_work, seven_segment_refresh_work);
+    INIT_DELAYED_WORK(&ssd->source.work, seven_segment_source_work);
+    ssd->effect = SEVENSEGMENT_EFFECT_NONE;
+    ssd->scroll.speed = SEVENSEGMENT_DEFAULT_SCROLL_SPEED;
+    ssd->scroll.mode = SEVENSEGMENT_SCROLL_LOOP;
+    hrtimer_init(&ssd->effect_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    ssd->effect_timer.function = seven_segment_effect_timer;
+    ssd->dimmer.mode = SEVENSEGMENT_DIMMER_NONE;
+    hrtimer_init(&ssd->dimmer_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    ssd->dimmer_timer.function = seven_segment_dimmer_timer;
+
+    spin_lock_irq(&ssd->lock);
+    seven_segment_publish(ssd);
+    spin_unlock_irq(&ssd->lock);
+    return 0;
+}
+
+EXPORT_SYMBOL(seven_segment_init_display);
+
+// Call after seven_segment_unregister_display(), so nothing can schedule a new flush.
+void seven_segment_release_display(struct seven_segment_display *ssd){
+    hrtimer_cancel(&ssd->effect_timer);
+    hrtimer_cancel(&ssd->dimmer_timer);
+    cancel_delayed_work_sync(&ssd->refresh_work);
+    mutex_lock(&ssd->write_lock);
+    seven_segment_source_unbind(ssd);
+    mutex_unlock(&ssd->write_lock);
+    cancel_delayed_work_sync(&ssd->source.work);
+
+    if (ssd->bus){
+        // waits for the bus work and group flushes, in case they are sending to this display right now
+        mutex_lock(&ssd->bus->lock);
+        spin_lock_irq(&ssd->bus->queue_lock);
+        list_del_init(&ssd->bus_node);
+        spin_unlock_irq(&ssd->bus->queue_lock);
+        mutex_unlock(&ssd->bus->lock);
+
+        // and for the transfers still in flight
+        if (ssd->transport->teardown)
+            ssd->transport->teardown(ssd);
+    }
+
+    // Failed sends re-arm the flush. Nothing sends anymore and the flushes of a dead display do nothing,
+    // but one may have been armed before the display died.
+    cancel_delayed_work_sync(&ssd->flush_work);
+
+    if (ssd->bus){
+        mutex_lock(&seven_segment_registry_lock);
+        seven_segment_put_bus(ssd->bus);
+        mutex_unlock(&seven_segment_registry_lock);
+    }
+
+    // a leftover mapping holds its own reference to the page
+    __free_page(virt_to_page(ssd->shared));
+    free_percpu(ssd->stats);
+}
+
+EXPORT_SYMBOL(seven_segment_release_display);
+
+static void seven_segment_free_display(struct kref *ref){
+    struct seven_segment_display *ssd = container_of(ref, struct seven_segment_display, ref);
+
+    // the last mapping may have queued it after the display was released
+    cancel_delayed_work_sync(&ssd->refresh_work);
+    cancel_delayed_work_sync(&ssd->flush_work);
+    kfree(ssd);
+}
+
+// Drops the transport's reference, taken by seven_segment_init_display(), after the display is released.
+// Open files and mappings of /dev/ssdN hold their own. The display must start its kmalloc-ed allocation,
+// the core frees it, as the transport module may be gone by then.
+void seven_segment_put_display(struct seven_segment_display *ssd){
+    kref_put(&ssd->ref, seven_segment_free_display);
+}
+
+EXPORT_SYMBOL(seven_segment_put_display);
 
-static void seven_segment_set_brightness(struct seven_segment_display *client, uint8_t brightness){
-    char cmd[] = {SEVENSEGMENT_BRIGHTNESS, brightness};
-    seven_segment_send_cmd(client, cmd, 2);
+static void seven_segment_clear_fb(struct seven_segment_display* client){
+    unsigned long flags;
+    int i;
+
+    spin_lock_irqsave(&client->lock, flags);
+    for (i = 0; i < SEVENSEGMENT_DIGITS; ++i)
+        client->fb.cells[i] = ' ';
+    client->fb.chars = SEVENSEGMENT_DIRTY_CELLS;
+    client->fb.decimals = 0;
+    client->effect = SEVENSEGMENT_EFFECT_NONE;
+
+    // the clear command resets the panel anyway, pending cell and decimal updates are moot
+    client->dirty &= ~(SEVENSEGMENT_DIRTY_CELLS | SEVENSEGMENT_DIRTY_DECIMALS);
+    client->dirty |= SEVENSEGMENT_DIRTY_CLEAR;
+    seven_segment_publish(client);
+    spin_unlock_irqrestore(&client->lock, flags);
+}
+
+// Call with write_lock held.
+static void seven_segment_reset_screen(struct seven_segment_display* client){
+    seven_segment_source_unbind(client);
+    seven_segment_clear_fb(client);
+    seven_segment_schedule_flush(client);
 }
 
 static void seven_segment_factory_reset(struct seven_segment_display *client){
     char cmd[] = {SEVENSEGMENT_FACTORY_RESET};
-    seven_segment_send_cmd(client, cmd, 1);
+    seven_segment_send_cmd(client, cmd, 1, 0);
+}
+
+// The display takes these bytes as commands even where a character is expected, they must never
+// reach it as text
+static bool seven_segment_is_command(u8 c){
+    return (c >= SEVENSEGMENT_CLEAR_SCREEN && c <= SEVENSEGMENT_DIGIT_4) || c == SEVENSEGMENT_FACTORY_RESET;
+}
+
+static bool seven_segment_valid_text(const char *c, int len){
+    int i;
+
+    for (i = 0; i < len; ++i){
+        if (seven_segment_is_command(c[i])){
+            pr_err("Invalid character: 0x%02x\n", (u8)c[i]);
+            return false;
+        }
+    }
+    return true;
 }
 
 static int seven_segment_parse_and_send_text(struct seven_segment_display* client, char* c){
-    int ret, i;
+    unsigned long flags;
+    int ret, len, i;
     ret = strlen(c);
-    if (ret > 5) {
-        pr_err("Max 4 characters can be displayed, not %d.\n", ret);
+    len = ret;
+    if (len && c[len - 1] == '\n')
+        --len;
+
+    if (len > SEVENSEGMENT_DIGITS) {
+        pr_err("Max 4 characters can be displayed, not %d.\n", len);
         return -EINVAL;
     }
+    if (!seven_segment_valid_text(c, len))
+        return -EINVAL;
 
-    for (i = 0; i < ret - 1 ; ++i)
-        seven_segment_send_cmd(client, &c[i], 1);
+    spin_lock_irqsave(&client->lock, flags);
+    // pad with blanks, so leftovers from a longer previous text don't stay on the display
+    for (i = 0; i < SEVENSEGMENT_DIGITS; ++i)
+        client->fb.cells[i] = i < len ? c[i] : ' ';
+    client->fb.chars = SEVENSEGMENT_DIRTY_CELLS;
+    client->effect = SEVENSEGMENT_EFFECT_NONE;
+    seven_segment_update_dirty(client, SEVENSEGMENT_DIRTY_CELLS);
+    seven_segment_publish(client);
+    spin_unlock_irqrestore(&client->lock, flags);
 
-    strncpy(client->text, c, 4);
-    client->text[4] = 0; // just to make sure that it's null-terminated.
     return ret;
 }
 
 static int seven_segment_parse_and_set_custom_digit(struct seven_segment_display* client, char* c, int digit){
+    unsigned long flags;
     int ret, i;
-    char cmd[2];
     if (digit < 1 || digit > 4){
         pr_err("Invalid digit: %d. Must be between 1 and 4.\n", digit);
         return -EINVAL;
@@ -72,31 +822,22 @@ static int seven_segment_parse_and_set_custom_digit(struct seven_segment_display
         pr_err("Invalid value. Must be between 0 and 127");
         return -EINVAL;
     }
-    cmd[0] = (SEVENSEGMENT_DIGIT_1 + digit - 1);
-    cmd[1] = i;
-    seven_segment_send_cmd(client, cmd, 2);
 
-    switch(digit){
-    case 1:
-        client->digit1 = i;
-        break;
-    case 2:
-        client->digit2 = i;
-        break;
-    case 3:
-        client->digit3 = i;
-        break;
-    case 4:
-        client->digit4 = i;
-        break;
-    }
+    spin_lock_irqsave(&client->lock, flags);
+    client->fb.cells[digit - 1] = i;
+    client->fb.chars &= ~BIT(digit - 1);
+    client->effect = SEVENSEGMENT_EFFECT_NONE;
+    seven_segment_update_dirty(client, SEVENSEGMENT_DIRTY_CELL(digit - 1));
+    seven_segment_publish(client);
+    spin_unlock_irqrestore(&client->lock, flags);
+
 
     return strlen(c);
 }
 
 static int seven_segment_parse_and_set_decimals(struct seven_segment_display *client, char* c){
+    unsigned long flags;
     int ret, i;
-    char cmd[2];
 
     ret = kstrtoint(c, 10, &i);
     if (ret < 0){
@@ -107,14 +848,18 @@ static int seven_segment_parse_and_set_decimals(struct seven_segment_display *cl
         pr_err("Invalid value. Must be between 0 and 63");
         return -EINVAL;
     }
-    cmd[0] = SEVENSEGMENT_DECIMAL_CTRL;
-    cmd[1] = i;
-    seven_segment_send_cmd(client, cmd, 2);
-    client->decimals = i;
+
+    spin_lock_irqsave(&client->lock, flags);
+    client->fb.decimals = i;
+    seven_segment_update_dirty(client, SEVENSEGMENT_DIRTY_DECIMALS);
+    seven_segment_publish(client);
+    spin_unlock_irqrestore(&client->lock, flags);
+
     return strlen(c);
 }
 
 static int seven_segment_parse_and_set_brightness(struct seven_segment_display *client, char* c){
+    unsigned long flags;
     int i, ret;
     ret = kstrtoint(c, 10, &i);
     if (ret < 0 ){
@@ -124,218 +869,2222 @@ static int seven_segment_parse_and_set_brightness(struct seven_segment_display *
         pr_err("Out of range brightness, should be between 0 and 100!\n");
         return -EINVAL;
     }
-    seven_segment_set_brightness(client, i);
-    client->brightness = i;
+
+    spin_lock_irqsave(&client->lock, flags);
+    client->dimmer.mode = SEVENSEGMENT_DIMMER_NONE;
+    client->fb.brightness = i;
+    seven_segment_update_dirty(client, SEVENSEGMENT_DIRTY_BRIGHTNESS);
+    seven_segment_publish(client);
+    spin_unlock_irqrestore(&client->lock, flags);
+
     return strlen(c);
 }
 
-static enum SevenSegmentProcFile seven_segment_get_proc_enum(char* file_name){
-    if (!strncmp("brightness", file_name, strlen("brightness")))
-        return SEVENSEGMENT_BRIGHTNESS_FILE;
-    if (!strncmp("clear", file_name, strlen("clear")))
-        return SEVENSEGMENT_CLEAR_FILE;
-    if (!strncmp("custom_digit1", file_name, strlen("custom_digit1")))
-        return SEVENSEGMENT_CUSTOM_DIGIT1_FILE;
-    if (!strncmp("custom_digit2", file_name, strlen("custom_digit2")))
-        return SEVENSEGMENT_CUSTOM_DIGIT2_FILE;
-    if (!strncmp("custom_digit3", file_name, strlen("custom_digit3")))
-        return SEVENSEGMENT_CUSTOM_DIGIT3_FILE;
-    if (!strncmp("custom_digit4", file_name, strlen("custom_digit4")))
-        return SEVENSEGMENT_CUSTOM_DIGIT4_FILE;
-    if (!strncmp("decimals", file_name, strlen("decimals")))
-        return SEVENSEGMENT_DECIMALS_FILE;
-    if (!strncmp("name", file_name, strlen("name")))
-        return SEVENSEGMENT_NAME_FILE;
-    if (!strncmp("text", file_name, strlen("text")))
-        return SEVENSEGMENT_TEXT_FILE;
-
-    return SEVENSEGMENT_UNKNOWN_FILE;
-}
-
-void seven_segment_create_proc_files(struct proc_dir_entry* parent, struct proc_ops* pops){
-    if (!proc_create("text", 0664, parent, pops))
-        pr_err("Could not create text file in procfs!\n");
-    if (!proc_create("clear", 0220, parent, pops))
-        pr_err("Could not create clear file in procfs!\n");
-    if (!proc_create("decimals", 0664, parent, pops))
-        pr_err("Could not create decimals file in procfs!\n");
-    if (!proc_create("custom_digit1", 0664, parent, pops))
-        pr_err("Could not create custom_digit1 file in procfs!\n");
-    if (!proc_create("custom_digit2", 0664, parent, pops))
-        pr_err("Could not create custom_digit2 file in procfs!\n");
-    if (!proc_create("custom_digit3", 0664, parent, pops))
-        pr_err("Could not create custom_digit3 file in procfs!\n");
-    if (!proc_create("custom_digit4", 0664, parent, pops))
-        pr_err("Could not create custom_digit4 file in procfs!\n");
-    if (!proc_create("brightness", 0664, parent, pops))
-        pr_err("Could not create brightness file in procfs!\n");
-    if (!proc_create("name", 0444, parent, pops))
-        pr_err("Could not create name file in procfs!\n");
-}
-
-EXPORT_SYMBOL(seven_segment_create_proc_files);
-
-
-static size_t seven_segment_int_number_of_digits(int i){
-    size_t digitNum = 1;
+static const char * const seven_segment_overflow_modes[] = {
+    [SEVENSEGMENT_OVERFLOW_DASHES] = "dashes",
+    [SEVENSEGMENT_OVERFLOW_ERROR] = "error",
+};
 
-    if (i < 0){
-        ++digitNum; // minus sign
-        i *= -1;
+// Parses [+-]digits[.digits] into its absolute value scaled by 10^precision, rounded half up.
+static int seven_segment_parse_fixed(const char *c, unsigned int precision, bool *neg, u64 *val){
+    bool digits = false, round = false;
+    unsigned int frac = 0;
+
+    *neg = *c == '-';
+    if (*c == '-' || *c == '+')
+        ++c;
+
+    for (*val = 0; isdigit(*c); ++c){
+        digits = true;
+        *val = min(*val * 10 + (*c - '0'), SEVENSEGMENT_NUMBER_LIMIT);
     }
 
-    for (; i > 9; ++digitNum, i/=10);
-    return digitNum;
+    if (*c == '.'){
+        for (++c; isdigit(*c); ++c){
+            digits = true;
+            if (frac < precision){
+                *val = min(*val * 10 + (*c - '0'), SEVENSEGMENT_NUMBER_LIMIT);
+                ++frac;
+            } else if (frac++ == precision){
+                round = *c >= '5';
+            }
+        }
+    }
+
+    if (!digits || *c)
+        return -EINVAL;
+
+    for (; frac < precision; ++frac)
+        *val = min(*val * 10, SEVENSEGMENT_NUMBER_LIMIT);
+    *val += round;
+    return 0;
 }
 
-static ssize_t seven_segment_send_int_to_user(char __user** buf, loff_t** off, int i){
-    int ret;
-    char* tmp;
-    size_t digitNum = seven_segment_int_number_of_digits(i);
+// Renders a number into 4 cells and the matching decimal point bits. Fractional digits are
+// dropped, with rounding, as long as the number doesn't fit otherwise.
+static int seven_segment_render_number(const char *value, const struct seven_segment_number *opts, char *cells, u8 *points){
+    char digits[12];
+    unsigned int precision = opts->precision;
+    int ret, len, start, i;
+    bool neg;
+    u64 val, shown, scale = 1;
 
-    if (**off >= digitNum)
-        return 0;
+    ret = seven_segment_parse_fixed(value, precision, &neg, &val);
+    if (ret)
+        return ret;
 
-    tmp = kzalloc(digitNum, GFP_KERNEL);
-    sprintf(tmp, "%d", i);
+    for (shown = val;;){
+        len = snprintf(digits, sizeof(digits), "%0*llu", precision + 1, shown);
+        neg = neg && shown; // no "-0"
+        if (len + neg <= SEVENSEGMENT_DIGITS || !precision)
+            break;
+        // rounding the already rounded value again would carry: 1.4449 -> 1.445 -> 1.45
+        scale *= 10;
+        shown = div_u64(val + scale / 2, scale);
+        --precision;
+    }
 
-    ret = copy_to_user(*buf, tmp, digitNum);
-    if (ret < 0){
-        pr_err("Could not copy to user: %d.\n", ret);
-        ret = 0;
+    *points = 0;
+    if (len + neg > SEVENSEGMENT_DIGITS){
+        if (opts->overflow == SEVENSEGMENT_OVERFLOW_ERROR)
+            return -ERANGE;
+        memset(cells, '-', SEVENSEGMENT_DIGITS);
+        return 0;
+    }
+
+    if (opts->zeros){
+        // the sign stays in front of the zeros
+        memset(cells, '0', SEVENSEGMENT_DIGITS);
+        if (neg)
+            cells[0] = '-';
+        start = SEVENSEGMENT_DIGITS - len;
     } else {
-        ret = digitNum;
-        **off += digitNum;
+        memset(cells, ' ', SEVENSEGMENT_DIGITS);
+        start = opts->left ? neg : SEVENSEGMENT_DIGITS - len;
+        if (neg)
+            cells[start - 1] = '-';
     }
-    kfree(tmp);
-    return ret;
+
+    for (i = 0; i < len; ++i)
+        cells[start + i] = digits[i];
+    if (precision)
+        *points = BIT(start + len - precision - 1);
+    return 0;
 }
 
-static ssize_t seven_segment_send_str_to_user(char __user** buf, loff_t** off, char* str){
-    int ret;
-    size_t len;
+// Puts a rendered number into the framebuffer. Returns whether anything changed.
+static bool seven_segment_show_number(struct seven_segment_display *ssd, const char *cells, u8 points){
+    unsigned long flags;
+    bool changed;
 
-    if (!str)
-        return 0;
+    spin_lock_irqsave(&ssd->lock, flags);
+    memcpy(ssd->fb.cells, cells, SEVENSEGMENT_DIGITS);
+    ssd->fb.chars = SEVENSEGMENT_DIRTY_CELLS;
+    // the colon and apostrophe are left alone
+    ssd->fb.decimals = (ssd->fb.decimals & ~(BIT(SEVENSEGMENT_DIGITS) - 1)) | points;
+    ssd->effect = SEVENSEGMENT_EFFECT_NONE;
+    seven_segment_update_dirty(ssd, SEVENSEGMENT_DIRTY_CELLS | SEVENSEGMENT_DIRTY_DECIMALS);
+    changed = ssd->dirty;
+    seven_segment_publish(ssd);
+    spin_unlock_irqrestore(&ssd->lock, flags);
+    return changed;
+}
 
-    len = strnlen(str, 64); // 64 is arbitrary limit, no special meaning
-    if (**off >= len)
-        return 0;
+// Accepts a number and/or options: "12.5", "precision=1 align=right zeros=0 overflow=dashes -3.25".
+static int seven_segment_parse_and_set_number(struct seven_segment_display *client, char* c){
+    struct seven_segment_number opts = client->number;
+    char cells[SEVENSEGMENT_DIGITS];
+    char *token, *value = NULL, *arg;
+    bool zeros;
+    u8 points;
+    int ret, err, i;
 
-    ret = copy_to_user(*buf, str, len);
-    if (ret < 0){
-        pr_err("Could not copy to user: %d\n", ret);
-        ret = 0;
-    } else {
-        ret = len;
-        **off += len;
+    ret = strlen(c);
+    while ((token = strsep(&c, " \t\n"))){
+        if (!*token)
+            continue;
+
+        arg = strchr(token, '=');
+        if (!arg){
+            if (value){
+                pr_err("Only one number can be displayed\n");
+                return -EINVAL;
+            }
+            value = token;
+            continue;
+        }
+
+        *arg++ = 0;
+        if (!strcmp(token, "precision")){
+            if (kstrtouint(arg, 10, &opts.precision) || opts.precision > SEVENSEGMENT_NUMBER_MAX_PRECISION){
+                pr_err("Invalid precision: %s\n", arg);
+                return -EINVAL;
+            }
+        } else if (!strcmp(token, "align") && (!strcmp(arg, "left") || !strcmp(arg, "right"))){
+            opts.left = !strcmp(arg, "left");
+        } else if (!strcmp(token, "zeros") && !kstrtobool(arg, &zeros)){
+            opts.zeros = zeros;
+        } else if (!strcmp(token, "overflow") && (i = match_string(seven_segment_overflow_modes, ARRAY_SIZE(seven_segment_overflow_modes), arg)) >= 0){
+            opts.overflow = i;
+        } else {
+            pr_err("Invalid number option: %s=%s\n", token, arg);
+            return -EINVAL;
+        }
+    }
+
+    if (value){
+        err = seven_segment_render_number(value, &opts, cells, &points);
+        if (err){
+            pr_err("Could not display number: %s\n", value);
+            return err;
+        }
+    }
+    client->number = opts;
+
+    if (value){
+        seven_segment_source_unbind(client);
+        seven_segment_show_number(client, cells, points);
     }
     return ret;
 }
 
-ssize_t seven_segment_read_proc_file(struct seven_segment_display *ssd, struct file* f, char __user** buf, loff_t **off){
-    ssize_t ret;
-    enum SevenSegmentProcFile sspf;
-    sspf = seven_segment_get_proc_enum((char *)f->f_path.dentry->d_iname);
+static const char * const seven_segment_source_types[] = {
+    [SEVENSEGMENT_SOURCE_NONE] = "off",
+    [SEVENSEGMENT_SOURCE_THERMAL] = "thermal",
+    [SEVENSEGMENT_SOURCE_IIO] = "iio",
+};
 
-    switch(sspf){
+// The thermal core hands out zones without a reference, and one may go away with its driver.
+// So the zone is looked up by name for every sample, rather than kept while the source is bound.
+static int seven_segment_source_read(enum SevenSegmentSourceType type, const char *name, struct iio_channel *chan, int *val){
+    struct thermal_zone_device *tz;
+
+    switch (type){
+    case SEVENSEGMENT_SOURCE_THERMAL:
+        tz = thermal_zone_get_zone_by_name(name);
+        if (IS_ERR(tz))
+            return PTR_ERR(tz);
+        return thermal_zone_get_temp(tz, val);
+#if IS_REACHABLE(CONFIG_IIO)
+    case SEVENSEGMENT_SOURCE_IIO:
+        return iio_read_channel_processed(chan, val);
+#endif
+    default:
+        return -ENODEV;
+    }
+}
+
+static void seven_segment_source_work(struct work_struct *work){
+    struct seven_segment_source *src = container_of(to_delayed_work(work), struct seven_segment_source, work);
+    struct seven_segment_display *ssd = container_of(src, struct seven_segment_display, source);
+    char value[32], cells[SEVENSEGMENT_DIGITS], name[SEVENSEGMENT_SOURCE_NAME_MAX];
+    enum SevenSegmentSourceType type;
+    struct iio_channel *chan;
+    unsigned int generation;
+    s64 scaled, whole;
+    s32 frac;
+    u8 points;
+    int ret, val;
+
+    mutex_lock(&ssd->write_lock);
+    type = src->type;
+    if (type == SEVENSEGMENT_SOURCE_NONE){
+        mutex_unlock(&ssd->write_lock);
+        return;
+    }
+    strscpy(name, src->name, sizeof(name));
+    chan = src->chan;
+    generation = src->generation;
+    src->sampled = chan;
+    mutex_unlock(&ssd->write_lock);
+
+    // the sensor may sleep on a slow bus, the writers of the display don't wait for it
+    ret = seven_segment_source_read(type, name, chan, &val);
+
+    mutex_lock(&ssd->write_lock);
+    src->sampled = NULL;
+    // unbound while it was read: the value is stale, and the channel was left for us to release
+    if (src->generation != generation){
+#if IS_REACHABLE(CONFIG_IIO)
+        if (chan && chan != src->chan)
+            iio_channel_release(chan);
+#endif
+        mutex_unlock(&ssd->write_lock);
+        return;
+    }
+
+    if (ret < 0){
+        pr_err_ratelimited("Could not read %s %s: %d\n", seven_segment_source_types[type], name, ret);
+        goto out;
+    }
+
+    // three decimals are more than a 4 digit display can show, the number rounds them
+    if (src->div == 1){
+        snprintf(value, sizeof(value), "%d", val);
+    } else {
+        scaled = div_s64((s64)val * 1000, src->div);
+        whole = div_s64_rem(scaled, 1000, &frac);
+        snprintf(value, sizeof(value), "%s%lld.%03d", scaled < 0 ? "-" : "", abs(whole), abs(frac));
+    }
+
+    // values that don't fit show as dashes, error mode makes no sense without a writer
+    if (!seven_segment_render_number(value, &src->number, cells, &points) && seven_segment_show_number(ssd, cells, points))
+        seven_segment_schedule_flush(ssd);
+
+out:
+    queue_delayed_work(system_unbound_wq, &src->work, msecs_to_jiffies(src->interval));
+    mutex_unlock(&ssd->write_lock);
+}
+
+// Also called by every direct write of the digits, the source would overwrite them. The work may
+// be reading the sensor right now, it finds the source unbound afterwards. Call with write_lock held.
+static void seven_segment_source_unbind(struct seven_segment_display *ssd){
+    struct seven_segment_source *src = &ssd->source;
+
+    if (src->type == SEVENSEGMENT_SOURCE_NONE)
+        return;
+
+    cancel_delayed_work(&src->work);
+    ++src->generation;
+#if IS_REACHABLE(CONFIG_IIO)
+    // a channel being read is released by the work, when it's done with it
+    if (src->chan && src->chan != src->sampled)
+        iio_channel_release(src->chan);
+#endif
+    src->chan = NULL;
+    spin_lock_irq(&ssd->lock);
+    write_seqcount_begin(&ssd->state_seq);
+    src->type = SEVENSEGMENT_SOURCE_NONE;
+    write_seqcount_end(&ssd->state_seq);
+    spin_unlock_irq(&ssd->lock);
+}
+
+// "thermal <zone type> [interval=ms] [div=N]", "iio <channel> [interval=ms] [div=N]" or "off".
+// The value is formatted with the options of the number file.
+static int seven_segment_parse_and_set_source(struct seven_segment_display *client, char* c){
+    struct seven_segment_source *src = &client->source;
+    unsigned int interval = SEVENSEGMENT_DEFAULT_SOURCE_INTERVAL;
+    struct thermal_zone_device *tz;
+    struct iio_channel *chan = NULL;
+    char *type, *name, *token, *arg;
+    int ret, div = 1, i;
+
+    ret = strlen(c);
+    type = strsep(&c, " \t\n");
+    i = match_string(seven_segment_source_types, ARRAY_SIZE(seven_segment_source_types), type);
+    if (i < 0){
+        pr_err("Invalid source: %s\n", type);
+        return -EINVAL;
+    }
+
+    if (i == SEVENSEGMENT_SOURCE_NONE){
+        seven_segment_source_unbind(client);
+        return ret;
+    }
+
+    do {
+        name = strsep(&c, " \t\n");
+    } while (name && !*name);
+    if (!name || strlen(name) >= SEVENSEGMENT_SOURCE_NAME_MAX){
+        pr_err("Invalid %s source name\n", type);
+        return -EINVAL;
+    }
+
+    while ((token = strsep(&c, " \t\n"))){
+        if (!*token)
+            continue;
+
+        arg = strchr(token, '=');
+        if (arg)
+            *arg++ = 0;
+        if (arg && !strcmp(token, "interval") && !kstrtouint(arg, 10, &interval) &&
+            interval >= SEVENSEGMENT_MIN_SOURCE_INTERVAL && interval <= SEVENSEGMENT_MAX_SOURCE_INTERVAL)
+            continue;
+        if (arg && !strcmp(token, "div") && !kstrtoint(arg, 10, &div) && div > 0)
+            continue;
+
+        pr_err("Invalid source option: %s\n", token);
+        return -EINVAL;
+    }
+
+    if (i == SEVENSEGMENT_SOURCE_THERMAL){
+        // only checked here, see seven_segment_source_read()
+        tz = thermal_zone_get_zone_by_name(name);
+        if (IS_ERR(tz)){
+            pr_err("No thermal zone %s\n", name);
+            return PTR_ERR(tz);
+        }
+    } else {
+#if IS_REACHABLE(CONFIG_IIO)
+        chan = iio_channel_get(client->transport->dev(client), name);
+        if (IS_ERR(chan)){
+            pr_err("No iio channel %s\n", name);
+            return PTR_ERR(chan);
+        }
+#else
+        pr_err("iio support is not available\n");
+        return -EOPNOTSUPP;
+#endif
+    }
+
+    seven_segment_source_unbind(client);
+    ++src->generation;
+    src->chan = chan;
+    src->number = client->number;
+    // what the source file shows is published for lockless readers
+    spin_lock_irq(&client->lock);
+    write_seqcount_begin(&client->state_seq);
+    src->type = i;
+    strscpy(src->name, name, sizeof(src->name));
+    src->interval = interval;
+    src->div = div;
+    write_seqcount_end(&client->state_seq);
+    spin_unlock_irq(&client->lock);
+    src->number.overflow = SEVENSEGMENT_OVERFLOW_DASHES;
+    queue_delayed_work(system_unbound_wq, &src->work, 0);
+    return ret;
+}
+
+static int seven_segment_parse_and_set_priority(struct seven_segment_display *client, char* c){
+    bool priority;
+
+    if (kstrtobool(c, &priority) < 0){
+        pr_err("Invalid priority: %s\n", c);
+        return -EINVAL;
+    }
+
+    WRITE_ONCE(client->priority, priority);
+    return strlen(c);
+}
+
+static int seven_segment_parse_and_set_refresh_rate(struct seven_segment_display *client, char* c){
+    int i, ret;
+    ret = kstrtoint(c, 10, &i);
+    if (ret < 0 ){
+        pr_err("Invalid refresh rate: %s\n", c);
+        return -EINVAL;
+    } else if (i < 0 || i > SEVENSEGMENT_MAX_REFRESH_RATE) {
+        pr_err("Out of range refresh rate, should be between 0 and %d!\n", SEVENSEGMENT_MAX_REFRESH_RATE);
+        return -EINVAL;
+    }
+
+    WRITE_ONCE(client->refresh_rate, i);
+    return strlen(c);
+}
+
+static const char * const seven_segment_scroll_modes[] = {
+    [SEVENSEGMENT_SCROLL_ONCE] = "once",
+    [SEVENSEGMENT_SCROLL_LOOP] = "loop",
+    [SEVENSEGMENT_SCROLL_BOUNCE] = "bounce",
+};
+
+// Shows the current window of the scrolled text. Call with ssd->lock held.
+static void seven_segment_scroll_render(struct seven_segment_display *ssd){
+    struct seven_segment_scroll *scroll = &ssd->scroll;
+    int i, pos;
+
+    for (i = 0; i < SEVENSEGMENT_DIGITS; ++i){
+        pos = scroll->pos + i;
+        // in loop mode the text is followed by a blank screen, before it starts over
+        if (scroll->mode == SEVENSEGMENT_SCROLL_LOOP)
+            pos %= scroll->len + SEVENSEGMENT_DIGITS;
+        ssd->fb.cells[i] = pos < scroll->len ? scroll->text[pos] : ' ';
+    }
+    ssd->fb.chars = SEVENSEGMENT_DIRTY_CELLS;
+    seven_segment_update_dirty(ssd, SEVENSEGMENT_DIRTY_CELLS);
+    seven_segment_publish(ssd);
+}
+
+// Advances the scrolled text by one step. Returns false when the text reached its end.
+// Call with ssd->lock held.
+static bool seven_segment_scroll_step(struct seven_segment_display *ssd){
+    struct seven_segment_scroll *scroll = &ssd->scroll;
+    int last = scroll->len - SEVENSEGMENT_DIGITS;
+
+    switch (scroll->mode){
+    case SEVENSEGMENT_SCROLL_ONCE:
+        if (scroll->pos >= last)
+            return false;
+        ++scroll->pos;
+        break;
+    case SEVENSEGMENT_SCROLL_LOOP:
+        scroll->pos = (scroll->pos + 1) % (scroll->len + SEVENSEGMENT_DIGITS);
+        break;
+    case SEVENSEGMENT_SCROLL_BOUNCE:
+        if (scroll->pos + scroll->dir < 0 || scroll->pos + scroll->dir > last)
+            scroll->dir = -scroll->dir;
+        scroll->pos += scroll->dir;
+        break;
+    }
+
+    seven_segment_scroll_render(ssd);
+    return true;
+}
+
+static int seven_segment_parse_and_set_scroll(struct seven_segment_display *client, char* c){
+    struct seven_segment_scroll *scroll = &client->scroll;
+    unsigned long flags;
+    unsigned int speed;
+    int ret, len;
+
+    ret = strlen(c);
+    len = ret;
+    if (len && c[len - 1] == '\n')
+        --len;
+
+    if (len > SEVENSEGMENT_SCROLL_MAX){
+        pr_err("Max %d characters can be scrolled, not %d.\n", SEVENSEGMENT_SCROLL_MAX, len);
+        return -EINVAL;
+    }
+    if (!seven_segment_valid_text(c, len))
+        return -EINVAL;
+
+    if (len)
+        seven_segment_source_unbind(client);
+
+    spin_lock_irqsave(&client->lock, flags);
+    write_seqcount_begin(&client->state_seq);
+    memcpy(scroll->text, c, len);
+    scroll->text[len] = 0;
+    write_seqcount_end(&client->state_seq);
+    scroll->len = len;
+    scroll->pos = 0;
+    scroll->dir = 1;
+    speed = scroll->speed;
+
+    // an empty text only stops scrolling, and leaves the display as it is
+    if (len)
+        seven_segment_scroll_render(client);
+    client->effect = len > SEVENSEGMENT_DIGITS ? SEVENSEGMENT_EFFECT_SCROLL : SEVENSEGMENT_EFFECT_NONE;
+    spin_unlock_irqrestore(&client->lock, flags);
+
+    if (len > SEVENSEGMENT_DIGITS)
+        hrtimer_start(&client->effect_timer, ms_to_ktime(speed), HRTIMER_MODE_REL);
+    return ret;
+}
+
+static int seven_segment_parse_and_set_scroll_speed(struct seven_segment_display *client, char* c){
+    unsigned long flags;
+    int i, ret;
+    ret = kstrtoint(c, 10, &i);
+    if (ret < 0 ){
+        pr_err("Invalid scroll speed: %s\n", c);
+        return -EINVAL;
+    } else if (i < SEVENSEGMENT_MIN_SCROLL_SPEED || i > SEVENSEGMENT_MAX_SCROLL_SPEED) {
+        pr_err("Out of range scroll speed, should be between %d and %d!\n", SEVENSEGMENT_MIN_SCROLL_SPEED, SEVENSEGMENT_MAX_SCROLL_SPEED);
+        return -EINVAL;
+    }
+
+    // takes effect from the next step
+    spin_lock_irqsave(&client->lock, flags);
+    client->scroll.speed = i;
+    spin_unlock_irqrestore(&client->lock, flags);
+    return strlen(c);
+}
+
+static int seven_segment_parse_and_set_scroll_mode(struct seven_segment_display *client, char* c){
+    unsigned long flags;
+    int mode;
+
+    mode = sysfs_match_string(seven_segment_scroll_modes, c);
+    if (mode < 0){
+        pr_err("Invalid scroll mode: %s\n", c);
+        return -EINVAL;
+    }
+
+    spin_lock_irqsave(&client->lock, flags);
+    client->scroll.mode = mode;
+    client->scroll.dir = 1;
+    // the position may be in the trailing blank part of loop mode
+    if (client->scroll.pos > max(client->scroll.len - SEVENSEGMENT_DIGITS, 0))
+        client->scroll.pos = 0;
+    spin_unlock_irqrestore(&client->lock, flags);
+    return strlen(c);
+}
+
+static int seven_segment_validate_frame(const struct ssd_frame *frame){
+    int i;
+
+    if (frame->reserved || frame->flags & ~(SSD_FRAME_CHARS | SSD_FRAME_KEEP_DECIMALS | SSD_FRAME_KEEP_BRIGHTNESS | SSD_FRAME_URGENT))
+        return -EINVAL;
+
+    for (i = 0; i < SEVENSEGMENT_DIGITS; ++i){
+        if (!(frame->flags & SSD_FRAME_CHAR(i)) && frame->segments[i] > 127)
+            return -EINVAL;
+        if ((frame->flags & SSD_FRAME_CHAR(i)) && seven_segment_is_command(frame->segments[i]))
+            return -EINVAL;
+    }
+
+    if (!(frame->flags & SSD_FRAME_KEEP_DECIMALS) && frame->decimals > 63)
+        return -EINVAL;
+    if (!(frame->flags & SSD_FRAME_KEEP_BRIGHTNESS) && frame->brightness > 100)
+        return -EINVAL;
+    return 0;
+}
+
+// Lockless, readers never hold up the writers.
+static void seven_segment_get_frame(struct seven_segment_display *ssd, struct ssd_frame *frame){
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&ssd->state_seq);
+        memcpy(frame, &ssd->state, sizeof(*frame));
+    } while (read_seqcount_retry(&ssd->state_seq, seq));
+}
+
+static void seven_segment_get_event(struct seven_segment_display *ssd, struct ssd_event *event){
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&ssd->state_seq);
+        event->generation = ssd->generation;
+        memcpy(&event->frame, &ssd->state, sizeof(event->frame));
+    } while (read_seqcount_retry(&ssd->state_seq, seq));
+}
+
+// Copies a validated frame into the framebuffer. Call with ssd->lock held.
+static void seven_segment_load_frame(struct seven_segment_display *ssd, const struct ssd_frame *frame){
+    unsigned long mask = SEVENSEGMENT_DIRTY_CELLS;
+
+    memcpy(ssd->fb.cells, frame->segments, SEVENSEGMENT_DIGITS);
+    ssd->fb.chars = frame->flags & SSD_FRAME_CHARS;
+
+    if (!(frame->flags & SSD_FRAME_KEEP_DECIMALS)){
+        ssd->fb.decimals = frame->decimals;
+        mask |= SEVENSEGMENT_DIRTY_DECIMALS;
+    }
+    if (!(frame->flags & SSD_FRAME_KEEP_BRIGHTNESS)){
+        ssd->fb.brightness = frame->brightness;
+        mask |= SEVENSEGMENT_DIRTY_BRIGHTNESS;
+    }
+    seven_segment_update_dirty(ssd, mask);
+    seven_segment_publish(ssd);
+}
+
+// Without digits only the decimals and brightness of frame are taken, the digits stay as the running
+// effect or the source sets them. Call with write_lock held.
+static int seven_segment_apply_frame(struct seven_segment_display *ssd, const struct ssd_frame *frame, bool digits){
+    struct ssd_frame keep;
+    unsigned long flags;
+    int ret;
+
+    ret = seven_segment_validate_frame(frame);
+    if (ret)
+        return ret;
+
+    if (digits)
+        seven_segment_source_unbind(ssd);
+    spin_lock_irqsave(&ssd->lock, flags);
+    if (digits){
+        ssd->effect = SEVENSEGMENT_EFFECT_NONE;
+    } else {
+        keep = *frame;
+        memcpy(keep.segments, ssd->fb.cells, SEVENSEGMENT_DIGITS);
+        keep.flags = (keep.flags & ~SSD_FRAME_CHARS) | (ssd->fb.chars & SSD_FRAME_CHARS);
+        frame = &keep;
+    }
+    if (!(frame->flags & SSD_FRAME_KEEP_BRIGHTNESS))
+        ssd->dimmer.mode = SEVENSEGMENT_DIMMER_NONE;
+    seven_segment_load_frame(ssd, frame);
+    if (frame->flags & SSD_FRAME_URGENT)
+        ssd->urgent = true;
+    spin_unlock_irqrestore(&ssd->lock, flags);
+
+    seven_segment_schedule_flush(ssd);
+    return 0;
+}
+
+static int seven_segment_set_frame(struct seven_segment_display *ssd, const struct ssd_frame *frame){
+    return seven_segment_apply_frame(ssd, frame, true);
+}
+
+// Sets several fields at once: a list of key=value pairs, out of text, decimals, brightness,
+// custom_digit1-4 and urgent. Values containing blanks can be quoted. Everything is validated
+// before anything is applied, then the fields go out together, in one update.
+static int seven_segment_parse_and_commit(struct seven_segment_display *client, char* c){
+    char *key, *value, *end, *p = c;
+    struct ssd_frame frame;
+    unsigned int n, len;
+    bool digits = false;
+    int ret, i;
+
+    ret = strlen(c);
+    seven_segment_get_frame(client, &frame);
+    frame.flags |= SSD_FRAME_KEEP_DECIMALS | SSD_FRAME_KEEP_BRIGHTNESS;
+
+    while (*(p = skip_spaces(p))){
+        key = p;
+        value = strchr(key, '=');
+        if (!value)
+            goto invalid;
+        *value++ = 0;
+
+        if (*value == '"'){
+            end = strchr(++value, '"');
+            if (!end)
+                goto invalid;
+        } else {
+            end = value + strcspn(value, " \t\n");
+        }
+        p = *end ? end + 1 : end;
+        *end = 0;
+
+        if (!strcmp(key, "text")){
+            len = strlen(value);
+            if (len > SEVENSEGMENT_DIGITS || !seven_segment_valid_text(value, len))
+                goto invalid;
+            for (i = 0; i < SEVENSEGMENT_DIGITS; ++i)
+                frame.segments[i] = i < len ? value[i] : ' ';
+            frame.flags |= SSD_FRAME_CHARS;
+            digits = true;
+        } else if (!strcmp(key, "decimals") && !kstrtouint(value, 10, &n) && n <= 63){
+            frame.decimals = n;
+            frame.flags &= ~SSD_FRAME_KEEP_DECIMALS;
+        } else if (!strcmp(key, "brightness") && !kstrtouint(value, 10, &n) && n <= 100){
+            frame.brightness = n;
+            frame.flags &= ~SSD_FRAME_KEEP_BRIGHTNESS;
+        } else if (!strncmp(key, "custom_digit", 12) && key[12] >= '1' && key[12] <= '4' && !key[13] &&
+                   !kstrtouint(value, 10, &n) && n <= 127){
+            frame.segments[key[12] - '1'] = n;
+            frame.flags &= ~SSD_FRAME_CHAR(key[12] - '1');
+            digits = true;
+        } else if (!strcmp(key, "urgent") && !kstrtouint(value, 10, &n) && n <= 1){
+            if (n)
+                frame.flags |= SSD_FRAME_URGENT;
+        } else {
+            goto invalid;
+        }
+    }
+
+    // only a commit of the digits stops the effects, brightness and decimals alone leave them running
+    i = seven_segment_apply_frame(client, &frame, digits);
+    return i ? i : ret;
+
+invalid:
+    pr_err("Invalid commit field: %s\n", key);
+    return -EINVAL;
+}
+
+// Shows the next frame of the animation, and reports how long it stays. Returns false when
+// the animation is over. Call with ssd->lock held.
+static bool seven_segment_animation_step(struct seven_segment_display *ssd, ktime_t *interval){
+    struct seven_segment_animation *anim = &ssd->anim;
+
+    if (anim->loop){
+        anim->cur = (anim->cur + 1) % anim->count;
+    } else {
+        // played frames are consumed, making room for appended ones
+        anim->head = (anim->head + 1) % SEVENSEGMENT_ANIM_MAX;
+        --anim->count;
+    }
+
+    if (!anim->count)
+        return false;
+
+    seven_segment_load_frame(ssd, &anim->frames[(anim->head + anim->cur) % SEVENSEGMENT_ANIM_MAX].frame);
+    *interval = ms_to_ktime(anim->frames[(anim->head + anim->cur) % SEVENSEGMENT_ANIM_MAX].duration_ms);
+    return true;
+}
+
+static int seven_segment_set_animation(struct seven_segment_display *ssd, const struct ssd_animation *upload){
+    struct seven_segment_animation *anim = &ssd->anim;
+    unsigned long flags;
+    ktime_t interval = 0;
+    bool start = false;
+    int ret, i;
+
+    if (upload->count > SSD_ANIM_MAX_FRAMES || upload->flags & ~(SSD_ANIM_LOOP | SSD_ANIM_APPEND))
+        return -EINVAL;
+
+    for (i = 0; i < upload->count; ++i){
+        ret = seven_segment_validate_frame(&upload->frames[i].frame);
+        if (ret)
+            return ret;
+        if (upload->frames[i].duration_ms < SEVENSEGMENT_ANIM_MIN_DURATION || upload->frames[i].duration_ms > SEVENSEGMENT_ANIM_MAX_DURATION)
+            return -EINVAL;
+    }
+
+    spin_lock_irqsave(&ssd->lock, flags);
+    if (!(upload->flags & SSD_ANIM_APPEND) || ssd->effect != SEVENSEGMENT_EFFECT_ANIMATION){
+        anim->head = 0;
+        anim->cur = 0;
+        anim->count = 0;
+        anim->loop = upload->flags & SSD_ANIM_LOOP;
+        start = upload->count;
+        // an empty upload stops the animation, the last frame stays on the display
+        ssd->effect = start ? SEVENSEGMENT_EFFECT_ANIMATION : SEVENSEGMENT_EFFECT_NONE;
+    }
+
+    if (anim->count + upload->count > SEVENSEGMENT_ANIM_MAX){
+        spin_unlock_irqrestore(&ssd->lock, flags);
+        return -ENOSPC;
+    }
+
+    for (i = 0; i < upload->count; ++i)
+        anim->frames[(anim->head + anim->count + i) % SEVENSEGMENT_ANIM_MAX] = upload->frames[i];
+    anim->count += upload->count;
+
+    if (start){
+        seven_segment_load_frame(ssd, &anim->frames[anim->head].frame);
+        interval = ms_to_ktime(anim->frames[anim->head].duration_ms);
+    }
+    spin_unlock_irqrestore(&ssd->lock, flags);
+
+    if (start){
+        seven_segment_source_unbind(ssd);
+        seven_segment_schedule_flush(ssd);
+        hrtimer_start(&ssd->effect_timer, interval, HRTIMER_MODE_REL);
+    }
+    return 0;
+}
+
+static const char * const seven_segment_clock_modes[] = {
+    [SEVENSEGMENT_CLOCK_HHMM] = "hh:mm",
+    [SEVENSEGMENT_CLOCK_MMSS] = "mm:ss",
+    [SEVENSEGMENT_CLOCK_STOPWATCH] = "stopwatch",
+    [SEVENSEGMENT_CLOCK_COUNTDOWN] = "countdown",
+};
+
+// Shows a duration as MM:SS, or as HH:MM from 100 minutes
+static void seven_segment_clock_duration(u64 secs, unsigned int *hi, unsigned int *lo){
+    u32 rem;
+
+    // only the hours below 100 are shown, so the rest fits 32 bit math, a u64 modulo wouldn't link on 32 bit
+    if (secs < 100 * 60){
+        *hi = (u32)secs / 60;
+        *lo = (u32)secs % 60;
+    } else {
+        div_u64_rem(secs, 100 * 3600, &rem);
+        *hi = rem / 3600;
+        *lo = rem / 60 % 60;
+    }
+}
+
+// Shows the time, and reports in *next how long it is until the display changes. Returns false
+// when there is nothing more to show. Call with ssd->lock held.
+static bool seven_segment_clock_step(struct seven_segment_display *ssd, ktime_t *next){
+    unsigned int hi, lo, period = 1;
+    char cells[SEVENSEGMENT_DIGITS + 1];
+    bool running = true;
+    struct tm tm;
+    s64 left;
+    u32 rem;
+    u64 secs;
+
+    switch (ssd->clock.mode){
+    case SEVENSEGMENT_CLOCK_HHMM:
+    case SEVENSEGMENT_CLOCK_MMSS:
+        secs = div_u64_rem(ktime_get_real_ns(), NSEC_PER_SEC, &rem);
+        time64_to_tm(secs, -sys_tz.tz_minuteswest * 60, &tm);
+        if (ssd->clock.mode == SEVENSEGMENT_CLOCK_HHMM){
+            hi = tm.tm_hour;
+            lo = tm.tm_min;
+            period = 60;
+        } else {
+            hi = tm.tm_min;
+            lo = tm.tm_sec;
+        }
+        // wake up on the next second or minute boundary, not a fixed interval after the last one
+        *next = ktime_set(period - 1 - (period == 60 ? tm.tm_sec : 0), NSEC_PER_SEC - rem);
+        break;
+    case SEVENSEGMENT_CLOCK_STOPWATCH:
+        secs = div_u64_rem(ktime_to_ns(ktime_sub(ktime_get(), ssd->clock.base)), NSEC_PER_SEC, &rem);
+        seven_segment_clock_duration(secs, &hi, &lo);
+        *next = NSEC_PER_SEC - rem;
+        break;
+    case SEVENSEGMENT_CLOCK_COUNTDOWN:
+    default:
+        left = ktime_to_ns(ktime_sub(ssd->clock.base, ktime_get()));
+        if (left <= 0){
+            left = 0;
+            running = false;
+        }
+        // rounded up: the display reaches 00:00 when the time is up
+        secs = div_u64_rem(left, NSEC_PER_SEC, &rem);
+        if (rem)
+            ++secs;
+        seven_segment_clock_duration(secs, &hi, &lo);
+        *next = rem ? rem : NSEC_PER_SEC;
+        break;
+    }
+
+    snprintf(cells, sizeof(cells), "%02u%02u", hi, lo);
+    memcpy(ssd->fb.cells, cells, SEVENSEGMENT_DIGITS);
+    ssd->fb.chars = SEVENSEGMENT_DIRTY_CELLS;
+    ssd->fb.decimals = SEVENSEGMENT_DECIMAL_COLON;
+    // unchanged digits are left out of the update
+    seven_segment_update_dirty(ssd, SEVENSEGMENT_DIRTY_CELLS | SEVENSEGMENT_DIRTY_DECIMALS);
+    seven_segment_publish(ssd);
+    return running;
+}
+
+// "hh:mm", "mm:ss", "stopwatch", "countdown <seconds>", or "off"
+static int seven_segment_parse_and_set_clock(struct seven_segment_display *client, char* c){
+    unsigned int seconds = 0;
+    unsigned long flags;
+    char *mode, *arg;
+    ktime_t next;
+    bool running;
+    int ret, i;
+
+    ret = strlen(c);
+    arg = strim(c);
+    mode = strsep(&arg, " \t");
+
+    if (!strcmp(mode, "off")){
+        spin_lock_irqsave(&client->lock, flags);
+        if (client->effect == SEVENSEGMENT_EFFECT_CLOCK)
+            client->effect = SEVENSEGMENT_EFFECT_NONE;
+        spin_unlock_irqrestore(&client->lock, flags);
+        return ret;
+    }
+
+    i = match_string(seven_segment_clock_modes, ARRAY_SIZE(seven_segment_clock_modes), mode);
+    if (i < 0){
+        pr_err("Invalid clock mode: %s\n", mode);
+        return -EINVAL;
+    }
+
+    if (i == SEVENSEGMENT_CLOCK_COUNTDOWN){
+        if (!arg || kstrtouint(skip_spaces(arg), 10, &seconds) || seconds > SEVENSEGMENT_CLOCK_MAX_COUNTDOWN){
+            pr_err("The countdown needs the number of seconds, max %d\n", SEVENSEGMENT_CLOCK_MAX_COUNTDOWN);
+            return -EINVAL;
+        }
+    } else if (arg && *skip_spaces(arg)){
+        pr_err("Clock mode %s takes no argument\n", mode);
+        return -EINVAL;
+    }
+
+    seven_segment_source_unbind(client);
+
+    spin_lock_irqsave(&client->lock, flags);
+    client->clock.mode = i;
+    client->clock.base = ktime_add(ktime_get(), ktime_set(seconds, 0));
+    client->effect = SEVENSEGMENT_EFFECT_CLOCK;
+    running = seven_segment_clock_step(client, &next);
+    if (!running)
+        client->effect = SEVENSEGMENT_EFFECT_NONE;
+    spin_unlock_irqrestore(&client->lock, flags);
+
+    if (running)
+        hrtimer_start(&client->effect_timer, next, HRTIMER_MODE_REL);
+    return ret;
+}
+
+static enum hrtimer_restart seven_segment_effect_timer(struct hrtimer *timer){
+    struct seven_segment_display *ssd = container_of(timer, struct seven_segment_display, effect_timer);
+    unsigned long flags;
+    ktime_t interval = 0;
+    bool restart = false, aligned = false;
+
+    spin_lock_irqsave(&ssd->lock, flags);
+    switch (ssd->effect){
+    case SEVENSEGMENT_EFFECT_SCROLL:
+        restart = seven_segment_scroll_step(ssd);
+        interval = ms_to_ktime(ssd->scroll.speed);
+        break;
+    case SEVENSEGMENT_EFFECT_ANIMATION:
+        restart = seven_segment_animation_step(ssd, &interval);
+        break;
+    case SEVENSEGMENT_EFFECT_CLOCK:
+        restart = seven_segment_clock_step(ssd, &interval);
+        aligned = true;
+        break;
+    case SEVENSEGMENT_EFFECT_NONE:
+        break;
+    }
+    if (!restart)
+        ssd->effect = SEVENSEGMENT_EFFECT_NONE;
+    spin_unlock_irqrestore(&ssd->lock, flags);
+
+    // a finished countdown still has its last 00:00 to show
+    if (restart || aligned)
+        seven_segment_schedule_flush(ssd);
+    if (!restart)
+        return HRTIMER_NORESTART;
+
+    if (aligned){
+        // the clock computed the time until its next boundary itself
+        hrtimer_set_expires(timer, ktime_add(ktime_get(), interval));
+    } else {
+        // forwarding from the previous expiry keeps the steps evenly spaced, however late we run
+        hrtimer_forward_now(timer, interval);
+    }
+    return HRTIMER_RESTART;
+}
+
+// Display brightness for each perceived brightness, gamma 2.2. Anything but 0 stays lit.
+static const u8 seven_segment_gamma[101] = {
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 2, 2, 2, 2, 3,
+    3, 3, 4, 4, 4, 5, 5, 6, 6, 7,
+    7, 8, 8, 9, 9, 10, 11, 11, 12, 13,
+    13, 14, 15, 16, 16, 17, 18, 19, 20, 21,
+    22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+    33, 34, 35, 36, 37, 39, 40, 41, 43, 44,
+    46, 47, 49, 50, 52, 53, 55, 56, 58, 60,
+    61, 63, 65, 66, 68, 70, 72, 74, 75, 77,
+    79, 81, 83, 85, 87, 89, 91, 94, 96, 98,
+    100,
+};
+
+// The smallest perceived brightness that reaches the given display brightness.
+static u8 seven_segment_perceived(u8 brightness){
+    u8 i = 0;
+
+    while (i < 100 && seven_segment_gamma[i] < brightness)
+        ++i;
+    return i;
+}
+
+static const char * const seven_segment_fade_curves[] = {
+    [SEVENSEGMENT_FADE_LINEAR] = "linear",
+    [SEVENSEGMENT_FADE_EASE_IN] = "ease-in",
+    [SEVENSEGMENT_FADE_EASE_OUT] = "ease-out",
+    [SEVENSEGMENT_FADE_EASE_IN_OUT] = "ease-in-out",
+};
+
+static const char * const seven_segment_blink_patterns[] = {
+    [SEVENSEGMENT_BLINK_SLOW] = "slow",
+    [SEVENSEGMENT_BLINK_FAST] = "fast",
+    [SEVENSEGMENT_BLINK_HEARTBEAT] = "heartbeat",
+};
+
+// ms of each step, alternating between on and off, starting with on. 0 ends the pattern.
+static const unsigned int seven_segment_blink_steps[SEVENSEGMENT_BLINK_PATTERNS][5] = {
+    [SEVENSEGMENT_BLINK_SLOW] = { 500, 500 },
+    [SEVENSEGMENT_BLINK_FAST] = { 125, 125 },
+    [SEVENSEGMENT_BLINK_HEARTBEAT] = { 100, 150, 100, 650 },
+};
+
+// Maps the progress of a fade, 0 to 1024, through the easing curve.
+static unsigned int seven_segment_ease(enum SevenSegmentFadeCurve curve, unsigned int t){
+    switch (curve){
+    case SEVENSEGMENT_FADE_EASE_IN:
+        return t * t / 1024;
+    case SEVENSEGMENT_FADE_EASE_OUT:
+        return 1024 - (1024 - t) * (1024 - t) / 1024;
+    case SEVENSEGMENT_FADE_EASE_IN_OUT:
+        // smoothstep, 3t^2 - 2t^3
+        return t * t / 1024 * (3 * 1024 - 2 * t) / 1024;
+    case SEVENSEGMENT_FADE_LINEAR:
+    default:
+        return t;
+    }
+}
+
+// Sets the brightness for the current point of the fade. Returns false when the fade is over.
+// Call with ssd->lock held.
+static bool seven_segment_fade_step(struct seven_segment_display *ssd){
+    struct seven_segment_dimmer *dimmer = &ssd->dimmer;
+    s64 elapsed = ktime_ms_delta(ktime_get(), dimmer->start);
+    unsigned int t;
+
+    if (elapsed >= dimmer->duration){
+        ssd->fb.brightness = dimmer->target;
+        return false;
+    }
+
+    t = seven_segment_ease(dimmer->curve, div_u64(elapsed * 1024, dimmer->duration));
+    ssd->fb.brightness = seven_segment_gamma[dimmer->from + ((int)dimmer->to - dimmer->from) * (int)t / 1024];
+    return true;
+}
+
+// Moves to the next step of the blink pattern, and reports how long it lasts. Call with ssd->lock held.
+static void seven_segment_blink_step(struct seven_segment_display *ssd, ktime_t *interval){
+    struct seven_segment_dimmer *dimmer = &ssd->dimmer;
+    const unsigned int *steps = seven_segment_blink_steps[dimmer->pattern];
+
+    if (++dimmer->step >= ARRAY_SIZE(seven_segment_blink_steps[0]) || !steps[dimmer->step])
+        dimmer->step = 0;
+    ssd->fb.brightness = dimmer->step % 2 ? dimmer->low : dimmer->high;
+    *interval = ms_to_ktime(steps[dimmer->step]);
+}
+
+// Only the steps that change the brightness the display can show reach the bus.
+static enum hrtimer_restart seven_segment_dimmer_timer(struct hrtimer *timer){
+    struct seven_segment_display *ssd = container_of(timer, struct seven_segment_display, dimmer_timer);
+    ktime_t interval = ms_to_ktime(SEVENSEGMENT_DIMMER_STEP);
+    bool restart = false, changed;
+    unsigned long flags;
+
+    spin_lock_irqsave(&ssd->lock, flags);
+    switch (ssd->dimmer.mode){
+    case SEVENSEGMENT_DIMMER_FADE:
+        restart = seven_segment_fade_step(ssd);
+        break;
+    case SEVENSEGMENT_DIMMER_BLINK:
+        seven_segment_blink_step(ssd, &interval);
+        restart = true;
+        break;
+    case SEVENSEGMENT_DIMMER_NONE:
+        break;
+    }
+    if (!restart)
+        ssd->dimmer.mode = SEVENSEGMENT_DIMMER_NONE;
+    changed = ssd->fb.brightness != ssd->state.brightness;
+    if (changed){
+        seven_segment_update_dirty(ssd, SEVENSEGMENT_DIRTY_BRIGHTNESS);
+        seven_segment_publish(ssd);
+    }
+    spin_unlock_irqrestore(&ssd->lock, flags);
+
+    if (changed)
+        seven_segment_schedule_flush(ssd);
+    if (!restart)
+        return HRTIMER_NORESTART;
+
+    hrtimer_forward_now(timer, interval);
+    return HRTIMER_RESTART;
+}
+
+// "<brightness> [ms] [linear|ease-in|ease-out|ease-in-out]", fades from the current brightness.
+static int seven_segment_parse_and_set_fade(struct seven_segment_display *client, char* c){
+    struct seven_segment_dimmer *dimmer = &client->dimmer;
+    unsigned int duration = SEVENSEGMENT_DEFAULT_FADE_DURATION, target;
+    int ret, curve = SEVENSEGMENT_FADE_EASE_IN_OUT;
+    char *token, *arg;
+    unsigned long flags;
+
+    ret = strlen(c);
+    arg = strim(c);
+    token = strsep(&arg, " \t");
+    if (kstrtouint(token, 10, &target) || target > 100){
+        pr_err("Invalid fade target, should be between 0 and 100: %s\n", token);
+        return -EINVAL;
+    }
+
+    token = strsep(&arg, " \t");
+    if (token && *token && (kstrtouint(token, 10, &duration) || duration > SEVENSEGMENT_MAX_FADE_DURATION)){
+        pr_err("Invalid fade duration, max %d ms: %s\n", SEVENSEGMENT_MAX_FADE_DURATION, token);
+        return -EINVAL;
+    }
+
+    token = strsep(&arg, " \t");
+    if (token && *token){
+        curve = match_string(seven_segment_fade_curves, ARRAY_SIZE(seven_segment_fade_curves), token);
+        if (curve < 0){
+            pr_err("Invalid fade curve: %s\n", token);
+            return -EINVAL;
+        }
+    }
+
+    spin_lock_irqsave(&client->lock, flags);
+    dimmer->mode = SEVENSEGMENT_DIMMER_FADE;
+    dimmer->curve = curve;
+    dimmer->start = ktime_get();
+    dimmer->duration = duration;
+    dimmer->from = seven_segment_perceived(client->fb.brightness);
+    dimmer->to = seven_segment_perceived(target);
+    dimmer->target = target;
+    spin_unlock_irqrestore(&client->lock, flags);
+
+    // the first step is taken right away, a zero length fade is just a brightness change
+    hrtimer_start(&client->dimmer_timer, 0, HRTIMER_MODE_REL);
+    return ret;
+}
+
+// "slow", "fast" or "heartbeat", optionally followed by "low=<brightness>" for the off steps,
+// or "off". The current brightness is used for the on steps, and restored by "off".
+static int seven_segment_parse_and_set_blink(struct seven_segment_display *client, char* c){
+    struct seven_segment_dimmer *dimmer = &client->dimmer;
+    unsigned int low = 0;
+    unsigned long flags;
+    char *token, *arg;
+    int ret, i;
+
+    ret = strlen(c);
+    arg = strim(c);
+    token = strsep(&arg, " \t");
+
+    if (!strcmp(token, "off")){
+        spin_lock_irqsave(&client->lock, flags);
+        if (dimmer->mode == SEVENSEGMENT_DIMMER_BLINK){
+            dimmer->mode = SEVENSEGMENT_DIMMER_NONE;
+            client->fb.brightness = dimmer->high;
+            seven_segment_update_dirty(client, SEVENSEGMENT_DIRTY_BRIGHTNESS);
+            seven_segment_publish(client);
+        }
+        spin_unlock_irqrestore(&client->lock, flags);
+        return ret;
+    }
+
+    i = match_string(seven_segment_blink_patterns, ARRAY_SIZE(seven_segment_blink_patterns), token);
+    if (i < 0){
+        pr_err("Invalid blink pattern: %s\n", token);
+        return -EINVAL;
+    }
+
+    if (arg && *skip_spaces(arg)){
+        arg = skip_spaces(arg);
+        if (strncmp(arg, "low=", 4) || kstrtouint(arg + 4, 10, &low) || low > 100){
+            pr_err("Invalid blink option: %s\n", arg);
+            return -EINVAL;
+        }
+    }
+
+    spin_lock_irqsave(&client->lock, flags);
+    // a fade that is still running ends at its target before blinking starts
+    if (dimmer->mode == SEVENSEGMENT_DIMMER_FADE)
+        client->fb.brightness = dimmer->target;
+    if (dimmer->mode != SEVENSEGMENT_DIMMER_BLINK)
+        dimmer->high = client->fb.brightness;
+    dimmer->mode = SEVENSEGMENT_DIMMER_BLINK;
+    dimmer->pattern = i;
+    dimmer->low = low;
+    // the timer moves on to step 0 first
+    dimmer->step = -1;
+    spin_unlock_irqrestore(&client->lock, flags);
+
+    hrtimer_start(&client->dimmer_timer, 0, HRTIMER_MODE_REL);
+    return ret;
+}
+
+static const char * const seven_segment_health_states[] = {
+    [SEVENSEGMENT_HEALTH_OK] = "ok",
+    [SEVENSEGMENT_HEALTH_RETRYING] = "retrying",
+    [SEVENSEGMENT_HEALTH_OFFLINE] = "offline",
+};
+
+static const struct {
+    const char *name;
+    umode_t mode;
+} seven_segment_proc_files[SEVENSEGMENT_UNKNOWN_FILE] = {
+    [SEVENSEGMENT_BLINK_FILE] = { "blink", 0664 },
+    [SEVENSEGMENT_BRIGHTNESS_FILE] = { "brightness", 0664 },
+    [SEVENSEGMENT_CLEAR_FILE] = { "clear", 0220 },
+    [SEVENSEGMENT_CLOCK_FILE] = { "clock", 0664 },
+    [SEVENSEGMENT_COMMIT_FILE] = { "commit", 0220 },
+    [SEVENSEGMENT_CUSTOM_DIGIT1_FILE] = { "custom_digit1", 0664 },
+    [SEVENSEGMENT_CUSTOM_DIGIT2_FILE] = { "custom_digit2", 0664 },
+    [SEVENSEGMENT_CUSTOM_DIGIT3_FILE] = { "custom_digit3", 0664 },
+    [SEVENSEGMENT_CUSTOM_DIGIT4_FILE] = { "custom_digit4", 0664 },
+    [SEVENSEGMENT_DECIMALS_FILE] = { "decimals", 0664 },
+    [SEVENSEGMENT_FADE_FILE] = { "fade", 0664 },
+    [SEVENSEGMENT_HEALTH_FILE] = { "health", 0444 },
+    [SEVENSEGMENT_NAME_FILE] = { "name", 0444 },
+    [SEVENSEGMENT_NUMBER_FILE] = { "number", 0664 },
+    [SEVENSEGMENT_PRIORITY_FILE] = { "priority", 0664 },
+    [SEVENSEGMENT_REFRESH_RATE_FILE] = { "refresh_rate", 0664 },
+    [SEVENSEGMENT_SCROLL_FILE] = { "scroll", 0664 },
+    [SEVENSEGMENT_SCROLL_MODE_FILE] = { "scroll_mode", 0664 },
+    [SEVENSEGMENT_SCROLL_SPEED_FILE] = { "scroll_speed", 0664 },
+    [SEVENSEGMENT_SOURCE_FILE] = { "source", 0664 },
+    [SEVENSEGMENT_TEXT_FILE] = { "text", 0664 },
+};
+
+// The text currently shown, the characters of the frame without the padding
+static void seven_segment_get_text(struct seven_segment_display *ssd, char *text){
+    struct ssd_frame frame;
+    int i, len = 0;
+
+    seven_segment_get_frame(ssd, &frame);
+    for (i = 0; i < SEVENSEGMENT_DIGITS && (frame.flags & SSD_FRAME_CHAR(i)); ++i){
+        text[i] = frame.segments[i];
+        if (text[i] != ' ')
+            len = i + 1;
+    }
+    text[len] = 0;
+}
+
+// The segment bitmap of a digit, 0 if it holds a character
+static int seven_segment_get_digit(struct seven_segment_display *ssd, int digit){
+    struct ssd_frame frame;
+
+    seven_segment_get_frame(ssd, &frame);
+    return frame.flags & SSD_FRAME_CHAR(digit) ? 0 : frame.segments[digit];
+}
+
+static int seven_segment_show_proc_file(struct seq_file *m, void *v){
+    struct seven_segment_proc_file *pf = m->private;
+    struct seven_segment_display *ssd = pf->ssd;
+    char text[SEVENSEGMENT_DIGITS + 1];
+    char scroll[SEVENSEGMENT_SCROLL_MAX + 1];
+    struct seven_segment_dimmer dimmer;
+    enum SevenSegmentHealth health;
+    enum SevenSegmentSourceType source;
+    char name[SEVENSEGMENT_SOURCE_NAME_MAX];
+    unsigned int seq, failures, interval;
+    struct ssd_frame frame;
+    int div;
+
+    switch(pf->type){
+    case SEVENSEGMENT_BLINK_FILE:
+        spin_lock_irq(&ssd->lock);
+        dimmer = ssd->dimmer;
+        spin_unlock_irq(&ssd->lock);
+        if (dimmer.mode == SEVENSEGMENT_DIMMER_BLINK)
+            seq_printf(m, "%s low=%u", seven_segment_blink_patterns[dimmer.pattern], dimmer.low);
+        else
+            seq_puts(m, "off");
+        break;
     case SEVENSEGMENT_BRIGHTNESS_FILE:
-        ret = seven_segment_send_int_to_user(buf, off, ssd->brightness);
+        seven_segment_get_frame(ssd, &frame);
+        seq_printf(m, "%d", frame.brightness);
         break;
     case SEVENSEGMENT_TEXT_FILE:
-        ret = seven_segment_send_str_to_user(buf, off, ssd->text);
+        seven_segment_get_text(ssd, text);
+        seq_puts(m, text);
         break;
     case SEVENSEGMENT_CUSTOM_DIGIT1_FILE:
-        ret = seven_segment_send_int_to_user(buf, off, ssd->digit1);
+        seq_printf(m, "%d", seven_segment_get_digit(ssd, 0));
         break;
     case SEVENSEGMENT_CUSTOM_DIGIT2_FILE:
-        ret = seven_segment_send_int_to_user(buf, off, ssd->digit2);
+        seq_printf(m, "%d", seven_segment_get_digit(ssd, 1));
         break;
     case SEVENSEGMENT_CUSTOM_DIGIT3_FILE:
-        ret = seven_segment_send_int_to_user(buf, off, ssd->digit3);
+        seq_printf(m, "%d", seven_segment_get_digit(ssd, 2));
         break;
     case SEVENSEGMENT_CUSTOM_DIGIT4_FILE:
-        ret = seven_segment_send_int_to_user(buf, off, ssd->digit4);
+        seq_printf(m, "%d", seven_segment_get_digit(ssd, 3));
         break;
     case SEVENSEGMENT_DECIMALS_FILE:
-        ret = seven_segment_send_int_to_user(buf, off, ssd->decimals);
+        seven_segment_get_frame(ssd, &frame);
+        seq_printf(m, "%d", frame.decimals);
+        break;
+    case SEVENSEGMENT_FADE_FILE:
+        spin_lock_irq(&ssd->lock);
+        dimmer = ssd->dimmer;
+        spin_unlock_irq(&ssd->lock);
+        if (dimmer.mode == SEVENSEGMENT_DIMMER_FADE)
+            seq_printf(m, "%u %u %s", dimmer.target, dimmer.duration, seven_segment_fade_curves[dimmer.curve]);
+        else
+            seq_puts(m, "off");
+        break;
+    case SEVENSEGMENT_HEALTH_FILE:
+        spin_lock_irq(&ssd->lock);
+        health = ssd->health;
+        failures = ssd->failures;
+        spin_unlock_irq(&ssd->lock);
+        seq_printf(m, "%s failures=%u", seven_segment_health_states[health], failures);
+        break;
+    case SEVENSEGMENT_CLOCK_FILE:
+        if (READ_ONCE(ssd->effect) == SEVENSEGMENT_EFFECT_CLOCK)
+            seq_puts(m, seven_segment_clock_modes[READ_ONCE(ssd->clock.mode)]);
+        else
+            seq_puts(m, "off");
+        break;
+    case SEVENSEGMENT_NUMBER_FILE:
+        seq_printf(m, "precision=%u align=%s zeros=%d overflow=%s", READ_ONCE(ssd->number.precision),
+                   READ_ONCE(ssd->number.left) ? "left" : "right", READ_ONCE(ssd->number.zeros),
+                   seven_segment_overflow_modes[READ_ONCE(ssd->number.overflow)]);
+        break;
+    case SEVENSEGMENT_PRIORITY_FILE:
+        seq_printf(m, "%d", READ_ONCE(ssd->priority));
+        break;
+    case SEVENSEGMENT_REFRESH_RATE_FILE:
+        seq_printf(m, "%u", READ_ONCE(ssd->refresh_rate));
+        break;
+    case SEVENSEGMENT_SCROLL_FILE:
+        do {
+            seq = read_seqcount_begin(&ssd->state_seq);
+            memcpy(scroll, ssd->scroll.text, sizeof(scroll));
+        } while (read_seqcount_retry(&ssd->state_seq, seq));
+        seq_puts(m, scroll);
+        break;
+    case SEVENSEGMENT_SCROLL_MODE_FILE:
+        seq_puts(m, seven_segment_scroll_modes[READ_ONCE(ssd->scroll.mode)]);
+        break;
+    case SEVENSEGMENT_SCROLL_SPEED_FILE:
+        seq_printf(m, "%u", READ_ONCE(ssd->scroll.speed));
+        break;
+    case SEVENSEGMENT_SOURCE_FILE:
+        do {
+            seq = read_seqcount_begin(&ssd->state_seq);
+            source = ssd->source.type;
+            memcpy(name, ssd->source.name, sizeof(name));
+            interval = ssd->source.interval;
+            div = ssd->source.div;
+        } while (read_seqcount_retry(&ssd->state_seq, seq));
+        if (source == SEVENSEGMENT_SOURCE_NONE)
+            seq_puts(m, "off");
+        else
+            seq_printf(m, "%s %s interval=%u div=%d", seven_segment_source_types[source], name, interval, div);
         break;
     case SEVENSEGMENT_NAME_FILE:
-        if (ssd->device_type == SEVENSEGMENT_I2C){
-            ret = seven_segment_send_str_to_user(buf, off, ssd->device.i2c->name);
-        } else {
-            ret = seven_segment_send_str_to_user(buf, off, (char *)ssd->device.spi->dev.init_name);
+        seq_puts(m, ssd->transport->name(ssd));
+        break;
+    case SEVENSEGMENT_UNKNOWN_FILE:
+    case SEVENSEGMENT_CLEAR_FILE:
+    case SEVENSEGMENT_COMMIT_FILE:
+    default:
+        pr_err("Unknown file: %d\n", pf->type);
+        return -ENOENT;
+    }
+
+    return 0;
+}
+
+// Parses the value written to a file, and sets it in the framebuffer. The caller schedules the flush.
+static ssize_t seven_segment_apply_attr(struct seven_segment_display *ssd, enum SevenSegmentProcFile sspf, char *text){
+    ssize_t sz;
+
+    switch(sspf){
+    case SEVENSEGMENT_BLINK_FILE:
+        sz = seven_segment_parse_and_set_blink(ssd, text);
+        break;
+    case SEVENSEGMENT_BRIGHTNESS_FILE:
+        sz = seven_segment_parse_and_set_brightness(ssd, text);
+        break;
+    case SEVENSEGMENT_CLEAR_FILE:
+        seven_segment_clear_fb(ssd);
+        sz = strlen(text);
+        break;
+    case SEVENSEGMENT_TEXT_FILE:
+        sz = seven_segment_parse_and_send_text(ssd, text);
+        break;
+    case SEVENSEGMENT_CUSTOM_DIGIT1_FILE:
+        sz = seven_segment_parse_and_set_custom_digit(ssd, text, 1);
+        break;
+    case SEVENSEGMENT_CUSTOM_DIGIT2_FILE:
+        sz = seven_segment_parse_and_set_custom_digit(ssd, text, 2);
+        break;
+    case SEVENSEGMENT_CUSTOM_DIGIT3_FILE:
+        sz = seven_segment_parse_and_set_custom_digit(ssd, text, 3);
+        break;
+    case SEVENSEGMENT_CUSTOM_DIGIT4_FILE:
+        sz = seven_segment_parse_and_set_custom_digit(ssd, text, 4);
+        break;
+    case SEVENSEGMENT_DECIMALS_FILE:
+        sz = seven_segment_parse_and_set_decimals(ssd, text);
+        break;
+    case SEVENSEGMENT_FADE_FILE:
+        sz = seven_segment_parse_and_set_fade(ssd, text);
+        break;
+    case SEVENSEGMENT_CLOCK_FILE:
+        sz = seven_segment_parse_and_set_clock(ssd, text);
+        break;
+    case SEVENSEGMENT_COMMIT_FILE:
+        sz = seven_segment_parse_and_commit(ssd, text);
+        break;
+    case SEVENSEGMENT_NUMBER_FILE:
+        sz = seven_segment_parse_and_set_number(ssd, text);
+        break;
+    case SEVENSEGMENT_PRIORITY_FILE:
+        sz = seven_segment_parse_and_set_priority(ssd, text);
+        break;
+    case SEVENSEGMENT_REFRESH_RATE_FILE:
+        sz = seven_segment_parse_and_set_refresh_rate(ssd, text);
+        break;
+    case SEVENSEGMENT_SCROLL_FILE:
+        sz = seven_segment_parse_and_set_scroll(ssd, text);
+        break;
+    case SEVENSEGMENT_SCROLL_MODE_FILE:
+        sz = seven_segment_parse_and_set_scroll_mode(ssd, text);
+        break;
+    case SEVENSEGMENT_SCROLL_SPEED_FILE:
+        sz = seven_segment_parse_and_set_scroll_speed(ssd, text);
+        break;
+    case SEVENSEGMENT_SOURCE_FILE:
+        sz = seven_segment_parse_and_set_source(ssd, text);
+        break;
+    case SEVENSEGMENT_UNKNOWN_FILE:
+    default:
+        pr_err("Unknown file: %d\n", sspf);
+        sz = -ENOENT;
+    }
+
+    // Writing the digits directly replaces the source. number, commit, clock and scroll unbind it themselves,
+    // only when they set the digits.
+    if (sz >= 0){
+        switch (sspf){
+        case SEVENSEGMENT_CLEAR_FILE:
+        case SEVENSEGMENT_CUSTOM_DIGIT1_FILE:
+        case SEVENSEGMENT_CUSTOM_DIGIT2_FILE:
+        case SEVENSEGMENT_CUSTOM_DIGIT3_FILE:
+        case SEVENSEGMENT_CUSTOM_DIGIT4_FILE:
+        case SEVENSEGMENT_TEXT_FILE:
+            seven_segment_source_unbind(ssd);
+            break;
+        default:
+            break;
+        }
+    }
+    return sz;
+}
+
+static ssize_t seven_segment_write_proc_file(struct seven_segment_display *ssd, enum SevenSegmentProcFile sspf, const char __user* buf, size_t sz){
+    ssize_t ret;
+
+    if (sz > SEVENSEGMENT_WRITE_MAX){
+        pr_err("Max %d bytes can be written, not %zu.\n", SEVENSEGMENT_WRITE_MAX, sz);
+        return -EINVAL;
+    }
+
+    mutex_lock(&ssd->write_lock);
+    if (copy_from_user(ssd->write_buf, buf, sz)){
+        mutex_unlock(&ssd->write_lock);
+        return -EFAULT;
+    }
+    ssd->write_buf[sz] = 0;
+
+    ret = seven_segment_apply_attr(ssd, sspf, ssd->write_buf);
+    mutex_unlock(&ssd->write_lock);
+
+    if (ret >= 0)
+        seven_segment_schedule_flush(ssd);
+    return ret;
+}
+
+static ssize_t seven_segment_proc_write(struct file* f, const char __user* buf, size_t sz, loff_t* off){
+    struct seven_segment_proc_file *pf = pde_data(file_inode(f));
+    return seven_segment_write_proc_file(pf->ssd, pf->type, buf, sz);
+}
+
+static int seven_segment_proc_open(struct inode *inode, struct file *f){
+    return single_open(f, seven_segment_show_proc_file, pde_data(inode));
+}
+
+static const struct proc_ops seven_segment_pops = {
+    .proc_open = seven_segment_proc_open,
+    .proc_write = seven_segment_proc_write,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release,
+};
+
+static void seven_segment_create_proc_files(struct seven_segment_display *ssd){
+    struct seven_segment_proc_file *pf;
+    int i;
+
+    for (i = 0; i < SEVENSEGMENT_UNKNOWN_FILE; ++i){
+        // each file carries its display and type, so reads and writes need no lookup
+        pf = &ssd->files[i];
+        pf->ssd = ssd;
+        pf->type = i;
+        if (!proc_create_data(seven_segment_proc_files[i].name, seven_segment_proc_files[i].mode, ssd->procfolder, &seven_segment_pops, pf))
+            pr_err("Could not create %s file in procfs!\n", seven_segment_proc_files[i].name);
+    }
+}
+
+// Takes write_lock, unless the display is already unregistered. Open files and mappings can outlive it.
+static int seven_segment_lock_alive(struct seven_segment_display *ssd){
+    mutex_lock(&ssd->write_lock);
+    if (ssd->dead){
+        mutex_unlock(&ssd->write_lock);
+        return -ENODEV;
+    }
+    return 0;
+}
+
+static struct seven_segment_display *seven_segment_from_file(struct file *f){
+    struct seven_segment_reader *reader = f->private_data;
+    return reader->ssd;
+}
+
+static int seven_segment_dev_open(struct inode *inode, struct file *f){
+    struct seven_segment_reader *reader;
+    struct ssd_event event;
+
+    reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+    if (!reader)
+        return -ENOMEM;
+
+    // misc_open() points private_data to the miscdevice, and holds misc_mtx, so the display can't be
+    // unregistered before the reference is taken
+    reader->ssd = container_of(f->private_data, struct seven_segment_display, miscdev);
+    kref_get(&reader->ssd->ref);
+    // only the changes from now on are reported
+    seven_segment_get_event(reader->ssd, &event);
+    reader->seen = event.generation;
+    f->private_data = reader;
+    return 0;
+}
+
+static int seven_segment_dev_release(struct inode *inode, struct file *f){
+    struct seven_segment_reader *reader = f->private_data;
+
+    seven_segment_put_display(reader->ssd);
+    kfree(reader);
+    return 0;
+}
+
+// Reads the state, and marks it as seen by poll()
+static void seven_segment_dev_get_event(struct file *f, struct ssd_event *event){
+    struct seven_segment_reader *reader = f->private_data;
+
+    seven_segment_get_event(reader->ssd, event);
+    WRITE_ONCE(reader->seen, event->generation);
+}
+
+static ssize_t seven_segment_dev_read(struct file *f, char __user *buf, size_t sz, loff_t *off){
+    struct ssd_event event;
+
+    if (READ_ONCE(seven_segment_from_file(f)->dead))
+        return -ENODEV;
+    if (sz < sizeof(event.frame))
+        return -EINVAL;
+
+    seven_segment_dev_get_event(f, &event);
+    if (copy_to_user(buf, &event.frame, sizeof(event.frame)))
+        return -EFAULT;
+    return sizeof(event.frame);
+}
+
+static __poll_t seven_segment_dev_poll(struct file *f, struct poll_table_struct *wait){
+    struct seven_segment_reader *reader = f->private_data;
+    struct ssd_event event;
+
+    poll_wait(f, &reader->ssd->change_wait, wait);
+    if (READ_ONCE(reader->ssd->dead))
+        return EPOLLHUP | EPOLLERR;
+    seven_segment_get_event(reader->ssd, &event);
+    if (event.generation != READ_ONCE(reader->seen))
+        return EPOLLIN | EPOLLRDNORM;
+    return 0;
+}
+
+static ssize_t seven_segment_dev_write(struct file *f, const char __user *buf, size_t sz, loff_t *off){
+    struct seven_segment_display *ssd;
+    struct ssd_frame frame;
+    int ret;
+
+    if (sz != sizeof(frame))
+        return -EINVAL;
+
+    if (copy_from_user(&frame, buf, sizeof(frame)))
+        return -EFAULT;
+
+    ssd = seven_segment_from_file(f);
+    ret = seven_segment_lock_alive(ssd);
+    if (ret)
+        return ret;
+    ret = seven_segment_set_frame(ssd, &frame);
+    mutex_unlock(&ssd->write_lock);
+    return ret ? ret : sizeof(frame);
+}
+
+static long seven_segment_dev_ioctl(struct file *f, unsigned int cmd, unsigned long arg){
+    struct seven_segment_display *ssd = seven_segment_from_file(f);
+    void __user *argp = (void __user *)arg;
+    struct ssd_animation *anim;
+    struct ssd_event event;
+    struct ssd_frame frame;
+    int ret;
+
+    if (READ_ONCE(ssd->dead))
+        return -ENODEV;
+
+    switch (cmd){
+    case SSD_IOC_GET_FRAME:
+        seven_segment_get_frame(ssd, &frame);
+        if (copy_to_user(argp, &frame, sizeof(frame)))
+            return -EFAULT;
+        return 0;
+    case SSD_IOC_GET_EVENT:
+        seven_segment_dev_get_event(f, &event);
+        if (copy_to_user(argp, &event, sizeof(event)))
+            return -EFAULT;
+        return 0;
+    case SSD_IOC_SET_FRAME:
+        if (copy_from_user(&frame, argp, sizeof(frame)))
+            return -EFAULT;
+        ret = seven_segment_lock_alive(ssd);
+        if (ret)
+            return ret;
+        ret = seven_segment_set_frame(ssd, &frame);
+        mutex_unlock(&ssd->write_lock);
+        return ret;
+    case SSD_IOC_CLEAR:
+        ret = seven_segment_lock_alive(ssd);
+        if (ret)
+            return ret;
+        seven_segment_reset_screen(ssd);
+        mutex_unlock(&ssd->write_lock);
+        return 0;
+    case SSD_IOC_ANIMATE:
+        anim = memdup_user(argp, sizeof(*anim));
+        if (IS_ERR(anim))
+            return PTR_ERR(anim);
+        ret = seven_segment_lock_alive(ssd);
+        if (!ret){
+            ret = seven_segment_set_animation(ssd, anim);
+            mutex_unlock(&ssd->write_lock);
         }
-        break;
-    case SEVENSEGMENT_UNKNOWN_FILE:
-    case SEVENSEGMENT_CLEAR_FILE:
+        kfree(anim);
+        return ret;
     default:
-        pr_err("Unknown file: %s\n", f->f_path.dentry->d_iname);
-        ret = -ENOENT;
+        return -ENOTTY;
     }
+}
+
+// Every mapping, including the copies made by fork(), holds a reference to the display
+static void seven_segment_vm_open(struct vm_area_struct *vma){
+    struct seven_segment_display *ssd = vma->vm_private_data;
+
+    kref_get(&ssd->ref);
+    if (atomic_inc_return(&ssd->mappers) == 1 && !READ_ONCE(ssd->dead))
+        queue_delayed_work(system_unbound_wq, &ssd->refresh_work, 0);
+}
+
+static void seven_segment_vm_close(struct vm_area_struct *vma){
+    struct seven_segment_display *ssd = vma->vm_private_data;
+
+    atomic_dec(&ssd->mappers);
+    seven_segment_put_display(ssd);
+}
 
+static const struct vm_operations_struct seven_segment_vm_ops = {
+    .open = seven_segment_vm_open,
+    .close = seven_segment_vm_close,
+};
+
+static int seven_segment_dev_mmap(struct file *f, struct vm_area_struct *vma){
+    struct seven_segment_display *ssd = seven_segment_from_file(f);
+    int ret;
+
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE)
+        return -EINVAL;
+
+    // the page is freed when the display goes away
+    ret = seven_segment_lock_alive(ssd);
+    if (ret)
+        return ret;
+
+    ret = vm_insert_page(vma, vma->vm_start, virt_to_page(ssd->shared));
+    if (!ret){
+        vma->vm_private_data = ssd;
+        vma->vm_ops = &seven_segment_vm_ops;
+        seven_segment_vm_open(vma);
+    }
+    mutex_unlock(&ssd->write_lock);
     return ret;
 }
 
-EXPORT_SYMBOL(seven_segment_read_proc_file);
+static const struct file_operations seven_segment_fops = {
+    .owner = THIS_MODULE,
+    .open = seven_segment_dev_open,
+    .release = seven_segment_dev_release,
+    .read = seven_segment_dev_read,
+    .write = seven_segment_dev_write,
+    .poll = seven_segment_dev_poll,
+    .unlocked_ioctl = seven_segment_dev_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .mmap = seven_segment_dev_mmap,
+    .llseek = noop_llseek,
+};
 
-ssize_t seven_segment_write_proc_file(struct seven_segment_display *ssd, struct file* f, const char __user* buf, size_t sz){
+static int seven_segment_register_chardev(struct seven_segment_display *ssd){
     int ret;
-    enum SevenSegmentProcFile sspf;
-    char* text;
 
-    text = kmalloc(sz + 1, GFP_KERNEL);
-    if (!text){
-        pr_err("Could not allocate memory for text\n");
-        return -ENOMEM;
+    snprintf(ssd->miscname, sizeof(ssd->miscname), "ssd%d", ssd->idx);
+    ssd->miscdev.minor = MISC_DYNAMIC_MINOR;
+    ssd->miscdev.name = ssd->miscname;
+    ssd->miscdev.fops = &seven_segment_fops;
+    ssd->miscdev.mode = 0664;
+
+    ret = misc_register(&ssd->miscdev);
+    if (ret)
+        pr_err("Could not register /dev/%s: %d\n", ssd->miscname, ret);
+    return ret;
+}
+
+// Call with seven_segment_registry_lock held.
+static void seven_segment_group_remove_member(struct seven_segment_group *group, struct seven_segment_display *ssd){
+    int i;
+
+    for (i = 0; i < group->count; ++i){
+        if (group->members[i].ssd != ssd)
+            continue;
+
+        memmove(&group->members[i], &group->members[i + 1], (group->count - i - 1) * sizeof(group->members[0]));
+        --group->count;
+        return;
     }
+}
 
-    ret = copy_from_user(text, buf, sz);
-    if (ret < 0){
-        pr_err("Could not copy text from user\n");
+// Without a batched transfer, e.g. on spi where a message can't span multiple chip selects, members
+// get one transfer each, back to back while holding the bus.
+static void seven_segment_group_send_each(struct seven_segment_group *group, int first, int last){
+    struct seven_segment_group_member *member;
+    int i;
+
+    for (i = first; i < last; ++i){
+        member = &group->batch[i];
+        if (member->len && seven_segment_send_cmd(member->ssd, member->buf, member->len, member->sent) < 0)
+            seven_segment_update_failed(member->ssd, member->sent);
+    }
+}
+
+// Flushes all members of the group. Members are sorted by bus, each bus gets a single batch.
+static void seven_segment_group_flush_work(struct work_struct *work){
+    struct seven_segment_group *group = container_of(work, struct seven_segment_group, flush_work);
+    struct seven_segment_group_member *member;
+    struct seven_segment_bus *bus;
+    unsigned long flags, delay;
+    int count, first, last, i;
+    bool batched;
+
+    // Snapshot the members, the bus I/O doesn't hold up the registry. The references keep the displays
+    // and their buses around, even if they are unregistered in the meantime.
+    mutex_lock(&seven_segment_registry_lock);
+    count = group->count;
+    for (i = 0; i < count; ++i){
+        group->batch[i].ssd = group->members[i].ssd;
+        kref_get(&group->batch[i].ssd->ref);
+        ++group->batch[i].ssd->bus->users;
+    }
+    mutex_unlock(&seven_segment_registry_lock);
+
+    for (first = 0; first < count; first = last){
+        bus = group->batch[first].ssd->bus;
+        for (last = first + 1; last < count && group->batch[last].ssd->bus == bus; ++last);
+
+        // group updates wait for the bus' budget like any other, the batch is charged as a whole
+        for (;;){
+            mutex_lock(&bus->lock);
+            delay = seven_segment_bus_refill(bus);
+            if (!delay)
+                break;
+            mutex_unlock(&bus->lock);
+            schedule_timeout_uninterruptible(delay);
+        }
+
+        for (i = first; i < last; ++i){
+            member = &group->batch[i];
+            member->len = 0;
+            // unregistering marks the display dead before its release waits for the bus lock
+            if (READ_ONCE(member->ssd->dead))
+                continue;
+            spin_lock_irqsave(&member->ssd->lock, flags);
+            member->len = seven_segment_prepare_update(member->ssd, member->buf, &member->sent);
+            spin_unlock_irqrestore(&member->ssd->lock, flags);
+            if (member->len)
+                member->ssd->last_flush = jiffies;
+        }
+
+        batched = bus->transport->group_send;
+        if (batched)
+            bus->transport->group_send(group, first, last);
+        else
+            seven_segment_group_send_each(group, first, last);
+        for (i = first; i < last; ++i){
+            if (group->batch[i].len)
+                seven_segment_bus_charge(bus, group->batch[i].len, batched ? 0 : 1);
+        }
+        if (batched)
+            seven_segment_bus_charge(bus, 0, 1);
+        mutex_unlock(&bus->lock);
+    }
+
+    mutex_lock(&seven_segment_registry_lock);
+    for (i = 0; i < count; ++i)
+        seven_segment_put_bus(group->batch[i].ssd->bus);
+    mutex_unlock(&seven_segment_registry_lock);
+    for (i = 0; i < count; ++i)
+        seven_segment_put_display(group->batch[i].ssd);
+}
+
+static ssize_t seven_segment_group_proc_write(struct file* f, const char __user* buf, size_t sz, loff_t* off){
+    struct seven_segment_group_file *gf = pde_data(file_inode(f));
+    struct seven_segment_group *group = gf->group;
+    ssize_t ret = sz;
+    int i;
+
+    if (sz > SEVENSEGMENT_WRITE_MAX){
+        pr_err("Max %d bytes can be written, not %zu.\n", SEVENSEGMENT_WRITE_MAX, sz);
+        return -EINVAL;
+    }
+
+    // the registry lock protects write_buf of the group as well
+    mutex_lock(&seven_segment_registry_lock);
+    if (copy_from_user(group->write_buf, buf, sz)){
+        mutex_unlock(&seven_segment_registry_lock);
+        return -EFAULT;
+    }
+    group->write_buf[sz] = 0;
+
+    for (i = 0; i < group->count && ret >= 0; ++i){
+        mutex_lock(&group->members[i].ssd->write_lock);
+        ret = seven_segment_apply_attr(group->members[i].ssd, gf->type, group->write_buf);
+        mutex_unlock(&group->members[i].ssd->write_lock);
+    }
+    mutex_unlock(&seven_segment_registry_lock);
+
+    if (ret >= 0)
+        queue_work(system_unbound_wq, &group->flush_work);
+    return ret;
+}
+
+static const struct proc_ops seven_segment_group_pops = {
+    .proc_write = seven_segment_group_proc_write,
+};
+
+static int seven_segment_group_members_show(struct seq_file *m, void *v){
+    struct seven_segment_group *group = m->private;
+    int i;
+
+    mutex_lock(&seven_segment_registry_lock);
+    for (i = 0; i < group->count; ++i)
+        seq_printf(m, "%s%d", i ? " " : "", group->members[i].ssd->idx);
+    mutex_unlock(&seven_segment_registry_lock);
+    seq_putc(m, '\n');
+    return 0;
+}
+
+static int seven_segment_group_members_open(struct inode *inode, struct file *f){
+    return single_open(f, seven_segment_group_members_show, pde_data(inode));
+}
+
+static const struct proc_ops seven_segment_group_members_pops = {
+    .proc_open = seven_segment_group_members_open,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release,
+};
+
+static const enum SevenSegmentProcFile seven_segment_group_files[SEVENSEGMENT_GROUP_FILES] = {
+    SEVENSEGMENT_BRIGHTNESS_FILE,
+    SEVENSEGMENT_CLEAR_FILE,
+    SEVENSEGMENT_CUSTOM_DIGIT1_FILE,
+    SEVENSEGMENT_CUSTOM_DIGIT2_FILE,
+    SEVENSEGMENT_CUSTOM_DIGIT3_FILE,
+    SEVENSEGMENT_CUSTOM_DIGIT4_FILE,
+    SEVENSEGMENT_DECIMALS_FILE,
+    SEVENSEGMENT_TEXT_FILE,
+};
+
+static int seven_segment_compare_members(const void *a, const void *b){
+    const struct seven_segment_group_member *ma = a, *mb = b;
+
+    if (ma->ssd->bus != mb->ssd->bus)
+        return ma->ssd->bus < mb->ssd->bus ? -1 : 1;
+    return ma->ssd->idx - mb->ssd->idx;
+}
+
+// Call with seven_segment_registry_lock held.
+static struct seven_segment_group *seven_segment_find_group(const char *name){
+    struct seven_segment_group *group;
+
+    list_for_each_entry(group, &seven_segment_groups, node){
+        if (!strcmp(group->name, name))
+            return group;
+    }
+    return NULL;
+}
+
+// "name idx idx ..." creates a group of the listed displays
+static int seven_segment_create_group(char *text){
+    struct seven_segment_group *group;
+    struct seven_segment_display *ssd;
+    struct seven_segment_group_file *gf;
+    char *name, *token;
+    int count = 0, idx, ret, i;
+
+    text = strim(text);
+    name = strsep(&text, " ");
+    if (!*name || strlen(name) >= SEVENSEGMENT_GROUP_NAME_MAX || strchr(name, '/')){
+        pr_err("Invalid group name: %s\n", name);
+        return -EINVAL;
+    }
+
+    group = kzalloc(sizeof(*group), GFP_KERNEL);
+    if (!group)
         return -ENOMEM;
+    strscpy(group->name, name, sizeof(group->name));
+    INIT_WORK(&group->flush_work, seven_segment_group_flush_work);
+
+    mutex_lock(&seven_segment_registry_lock);
+    ret = -EEXIST;
+    if (seven_segment_find_group(name))
+        goto err;
+
+    while ((token = strsep(&text, " ")) != NULL){
+        if (!*token)
+            continue;
+
+        ret = kstrtoint(token, 10, &idx);
+        if (ret < 0)
+            goto err;
+
+        ret = -ENODEV;
+        ssd = idr_find(&seven_segment_idr, idx);
+        if (!ssd)
+            goto err;
+
+        ret = -E2BIG;
+        if (count == SEVENSEGMENT_GROUP_MAX_MEMBERS)
+            goto err;
+
+        // listing a display twice would only send its update twice
+        for (i = 0; i < count && group->members[i].ssd != ssd; ++i);
+        if (i == count)
+            group->members[count++].ssd = ssd;
+    }
+    group->count = count;
+    sort(group->members, count, sizeof(group->members[0]), seven_segment_compare_members, NULL);
+
+    ret = -ENOMEM;
+    group->procfolder = proc_mkdir(group->name, groupsparent);
+    if (!group->procfolder)
+        goto err;
+
+    for (i = 0; i < SEVENSEGMENT_GROUP_FILES; ++i){
+        gf = &group->files[i];
+        gf->group = group;
+        gf->type = seven_segment_group_files[i];
+        if (!proc_create_data(seven_segment_proc_files[gf->type].name, 0220, group->procfolder, &seven_segment_group_pops, gf))
+            pr_err("Could not create %s file in procfs!\n", seven_segment_proc_files[gf->type].name);
     }
+    if (!proc_create_data("members", 0444, group->procfolder, &seven_segment_group_members_pops, group))
+        pr_err("Could not create members file in procfs!\n");
+
+    list_add(&group->node, &seven_segment_groups);
+    mutex_unlock(&seven_segment_registry_lock);
+    return 0;
+
+err:
+    mutex_unlock(&seven_segment_registry_lock);
+    proc_remove(group->procfolder);
+    kfree(group);
+    return ret;
+}
+
+static void seven_segment_destroy_group(struct seven_segment_group *group){
+    // removing the files waits for the writers, after that nothing can queue the work
+    proc_remove(group->procfolder);
+    cancel_work_sync(&group->flush_work);
+    kfree(group);
+}
+
+static int seven_segment_remove_group(char *name){
+    struct seven_segment_group *group;
+
+    name = strim(name);
+    mutex_lock(&seven_segment_registry_lock);
+    group = seven_segment_find_group(name);
+    if (group)
+        list_del(&group->node);
+    mutex_unlock(&seven_segment_registry_lock);
+
+    if (!group)
+        return -ENOENT;
+
+    seven_segment_destroy_group(group);
+    return 0;
+}
+
+static ssize_t seven_segment_group_ctl_write(struct file* f, const char __user* buf, size_t sz, loff_t* off, int (*fn)(char *)){
+    char text[SEVENSEGMENT_GROUP_TEXT_MAX];
+    int ret;
+
+    if (sz >= sizeof(text))
+        return -EINVAL;
+
+    if (copy_from_user(text, buf, sz))
+        return -EFAULT;
     text[sz] = 0;
 
-    sspf = seven_segment_get_proc_enum((char *)f->f_path.dentry->d_iname);
+    ret = fn(text);
+    return ret ? ret : sz;
+}
 
-    switch(sspf){
-    case SEVENSEGMENT_BRIGHTNESS_FILE:
-        sz = seven_segment_parse_and_set_brightness(ssd, text);
-        break;
-    case SEVENSEGMENT_CLEAR_FILE:
-        seven_segment_reset_screen(ssd);
-        break;
-    case SEVENSEGMENT_TEXT_FILE:
-        sz = seven_segment_parse_and_send_text(ssd, text);
-        break;
-    case SEVENSEGMENT_CUSTOM_DIGIT1_FILE:
-        sz = seven_segment_parse_and_set_custom_digit(ssd, text, 1);
-        break;
-    case SEVENSEGMENT_CUSTOM_DIGIT2_FILE:
-        sz = seven_segment_parse_and_set_custom_digit(ssd, text, 2);
-        break;
-    case SEVENSEGMENT_CUSTOM_DIGIT3_FILE:
-        sz = seven_segment_parse_and_set_custom_digit(ssd, text, 3);
-        break;
-    case SEVENSEGMENT_CUSTOM_DIGIT4_FILE:
-        sz = seven_segment_parse_and_set_custom_digit(ssd, text, 4);
-        break;
-    case SEVENSEGMENT_DECIMALS_FILE:
-        sz = seven_segment_parse_and_set_decimals(ssd, text);
-        break;
-    case SEVENSEGMENT_UNKNOWN_FILE:
-    default:
-        pr_err("Unknown file: %s\n", f->f_path.dentry->d_iname);
-        sz = -ENOENT;
+static ssize_t seven_segment_group_create_write(struct file* f, const char __user* buf, size_t sz, loff_t* off){
+    return seven_segment_group_ctl_write(f, buf, sz, off, seven_segment_create_group);
+}
+
+static ssize_t seven_segment_group_remove_write(struct file* f, const char __user* buf, size_t sz, loff_t* off){
+    return seven_segment_group_ctl_write(f, buf, sz, off, seven_segment_remove_group);
+}
+
+static const struct proc_ops seven_segment_group_create_pops = {
+    .proc_write = seven_segment_group_create_write,
+};
+
+static const struct proc_ops seven_segment_group_remove_pops = {
+    .proc_write = seven_segment_group_remove_write,
+};
+
+static void seven_segment_stats_sum(struct seven_segment_display *ssd, struct seven_segment_stats *sum){
+    struct seven_segment_stats *stats;
+    int cpu, i;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu){
+        stats = per_cpu_ptr(ssd->stats, cpu);
+        sum->commands += READ_ONCE(stats->commands);
+        sum->bytes += READ_ONCE(stats->bytes);
+        sum->errors += READ_ONCE(stats->errors);
+        sum->coalesced += READ_ONCE(stats->coalesced);
+        sum->skipped += READ_ONCE(stats->skipped);
+        for (i = 0; i < SEVENSEGMENT_LATENCY_BUCKETS; ++i)
+            sum->latency[i] += READ_ONCE(stats->latency[i]);
     }
-    kfree(text);
-    return sz;
 }
 
-EXPORT_SYMBOL(seven_segment_write_proc_file);
+static int seven_segment_stats_show(struct seq_file *m, void *v){
+    struct seven_segment_display *ssd = m->private;
+    struct seven_segment_stats sum;
+    int i;
 
-int seven_segment_register_top_proc_dir(void) {
+    seven_segment_stats_sum(ssd, &sum);
+
+    seq_printf(m, "commands: %llu\n", sum.commands);
+    seq_printf(m, "bytes: %llu\n", sum.bytes);
+    seq_printf(m, "errors: %llu\n", sum.errors);
+    seq_printf(m, "coalesced: %llu\n", sum.coalesced);
+    seq_printf(m, "skipped: %llu\n", sum.skipped);
+    seq_puts(m, "latency_us:\n");
+    seq_printf(m, "%10s %10u: %llu\n", "", 1, sum.latency[0]);
+    for (i = 1; i < SEVENSEGMENT_LATENCY_BUCKETS - 1; ++i)
+        seq_printf(m, "%10u %10u: %llu\n", 1 << (i - 1), 1 << i, sum.latency[i]);
+    seq_printf(m, "%10u %10s: %llu\n", 1 << (i - 1), "", sum.latency[i]);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(seven_segment_stats);
+
+// Assigns the next free index to the display, and creates /proc/ssd/N and /dev/ssdN for it
+int seven_segment_register_display(struct seven_segment_display *ssd){
+    char procfsname[12];
+    int ret;
+
+    if (!procparent){
+        pr_err("procparent doesn't exist!\n");
+        return -ENOMEM;
+    }
+
+    if (ssd->transport->setup){
+        ret = ssd->transport->setup(ssd);
+        if (ret)
+            return ret;
+    }
+
+    mutex_lock(&seven_segment_registry_lock);
+    ssd->bus = seven_segment_get_bus(ssd);
+    if (!ssd->bus){
+        mutex_unlock(&seven_segment_registry_lock);
+        ret = -ENOMEM;
+        goto err_transport;
+    }
+
+    ret = idr_alloc(&seven_segment_idr, ssd, 0, 0, GFP_KERNEL);
+    if (ret < 0){
+        seven_segment_put_bus(ssd->bus);
+        mutex_unlock(&seven_segment_registry_lock);
+        pr_err("Could not allocate display index: %d\n", ret);
+        goto err_transport;
+    }
+    mutex_unlock(&seven_segment_registry_lock);
+    ssd->idx = ret;
+
+    snprintf(procfsname, sizeof(procfsname), "%d", ssd->idx);
+    ssd->procfolder = proc_mkdir(procfsname, procparent);
+    if (!ssd->procfolder)
+        pr_err("could not create ssd->procfolder!\n");
+    else
+        seven_segment_create_proc_files(ssd);
+
+    ssd->debugfs = debugfs_create_dir(procfsname, debugfsparent);
+    debugfs_create_file("stats", 0444, ssd->debugfs, ssd, &seven_segment_stats_fops);
+    if (ssd->transport->debugfs)
+        ssd->transport->debugfs(ssd);
+
+    ret = seven_segment_register_chardev(ssd);
+    if (ret){
+        debugfs_remove_recursive(ssd->debugfs);
+        proc_remove(ssd->procfolder);
+        mutex_lock(&seven_segment_registry_lock);
+        idr_remove(&seven_segment_idr, ssd->idx);
+        seven_segment_put_bus(ssd->bus);
+        mutex_unlock(&seven_segment_registry_lock);
+        goto err_transport;
+    }
+
+    // Bring the panel to a known state: clear it and restore the brightness. This goes out with
+    // the first flush, so probing never waits for the bus.
+    spin_lock_irq(&ssd->lock);
+    ssd->dirty |= SEVENSEGMENT_DIRTY_CLEAR | SEVENSEGMENT_DIRTY_BRIGHTNESS;
+    spin_unlock_irq(&ssd->lock);
+    seven_segment_schedule_flush(ssd);
+    return 0;
+
+err_transport:
+    // release_display must not touch the bus or the transport again
+    ssd->bus = NULL;
+    if (ssd->transport->teardown)
+        ssd->transport->teardown(ssd);
+    return ret;
+}
+
+EXPORT_SYMBOL(seven_segment_register_display);
+
+// The bus reference is dropped in seven_segment_release_display(), after the last flush
+void seven_segment_unregister_display(struct seven_segment_display *ssd){
+    struct seven_segment_group *group;
+
+    // from now on the open files of /dev/ssdN get -ENODEV
+    mutex_lock(&ssd->write_lock);
+    ssd->dead = true;
+    mutex_unlock(&ssd->write_lock);
+    wake_up_interruptible_poll(&ssd->change_wait, EPOLLHUP | EPOLLERR);
+
+    proc_remove(ssd->procfolder);
+    debugfs_remove_recursive(ssd->debugfs);
+    misc_deregister(&ssd->miscdev);
+
+    mutex_lock(&seven_segment_registry_lock);
+    list_for_each_entry(group, &seven_segment_groups, node)
+        seven_segment_group_remove_member(group, ssd);
+    idr_remove(&seven_segment_idr, ssd->idx);
+    mutex_unlock(&seven_segment_registry_lock);
+}
+
+EXPORT_SYMBOL(seven_segment_unregister_display);
+
+static const char * const seven_segment_transport_types[] = {
+    [SEVENSEGMENT_I2C] = "i2c",
+    [SEVENSEGMENT_SPI] = "spi",
+    [SEVENSEGMENT_VIRTUAL] = "virtual",
+};
+
+// One line per display, with space separated key=value pairs. Custom cells show up as '_' in text,
+// and with their bitmap in segments, where character cells are "--". Nothing here touches the bus.
+static int seven_segment_state_show(struct seq_file *m, void *v){
+    struct seven_segment_display *ssd;
+    struct seven_segment_stats stats;
+    enum SevenSegmentHealth health;
+    char text[SEVENSEGMENT_DIGITS + 1];
+    struct ssd_event event;
+    unsigned int failures;
+    u8 cell;
+    int idx, i;
+
+    mutex_lock(&seven_segment_registry_lock);
+    idr_for_each_entry(&seven_segment_idr, ssd, idx){
+        seven_segment_get_event(ssd, &event);
+        spin_lock_irq(&ssd->lock);
+        health = ssd->health;
+        failures = ssd->failures;
+        spin_unlock_irq(&ssd->lock);
+        seven_segment_stats_sum(ssd, &stats);
+
+        for (i = 0; i < SEVENSEGMENT_DIGITS; ++i){
+            cell = event.frame.segments[i];
+            if ((event.frame.flags & SSD_FRAME_CHAR(i)) && isprint(cell) && cell != '"')
+                text[i] = cell;
+            else
+                text[i] = '_';
+        }
+        text[SEVENSEGMENT_DIGITS] = 0;
+
+        seq_printf(m, "idx=%d name=%s transport=%s bus=%s text=\"%s\" segments=", ssd->idx, ssd->transport->name(ssd),
+                   seven_segment_transport_types[ssd->transport->type], ssd->bus ? ssd->bus->name : "-", text);
+        for (i = 0; i < SEVENSEGMENT_DIGITS; ++i){
+            if (event.frame.flags & SSD_FRAME_CHAR(i))
+                seq_printf(m, "%s--", i ? "," : "");
+            else
+                seq_printf(m, "%s%02x", i ? "," : "", event.frame.segments[i]);
+        }
+        seq_printf(m, " decimals=%u brightness=%u health=%s failures=%u generation=%llu", event.frame.decimals,
+                   event.frame.brightness, seven_segment_health_states[health], failures, event.generation);
+        seq_printf(m, " commands=%llu bytes=%llu errors=%llu coalesced=%llu skipped=%llu\n", stats.commands,
+                   stats.bytes, stats.errors, stats.coalesced, stats.skipped);
+    }
+    mutex_unlock(&seven_segment_registry_lock);
+    return 0;
+}
+
+static int seven_segment_register_top_proc_dir(void) {
     if (!procparent){
         procparent = proc_mkdir("ssd", NULL);
     }
@@ -344,9 +3093,80 @@ int seven_segment_register_top_proc_dir(void) {
         pr_err("/proc/ssd creation failed!\n");
         return -ENOMEM;
     }
+
+    if (!busesparent){
+        busesparent = proc_mkdir("buses", procparent);
+        if (!busesparent){
+            pr_err("/proc/ssd/buses creation failed!\n");
+            return -ENOMEM;
+        }
+    }
+
+    if (!statefile){
+        statefile = proc_create_single("state", 0444, procparent, seven_segment_state_show);
+        if (!statefile)
+            pr_err("Could not create state file in procfs!\n");
+    }
+
+    // debugfs is optional, failures are ignored
+    if (!debugfsparent)
+        debugfsparent = debugfs_create_dir("ssd", NULL);
+
+    if (!groupsparent){
+        groupsparent = proc_mkdir("groups", procparent);
+        if (!groupsparent){
+            pr_err("/proc/ssd/groups creation failed!\n");
+            return -ENOMEM;
+        }
+        if (!proc_create("create", 0220, groupsparent, &seven_segment_group_create_pops))
+            pr_err("Could not create groups/create file in procfs!\n");
+        if (!proc_create("remove", 0220, groupsparent, &seven_segment_group_remove_pops))
+            pr_err("Could not create groups/remove file in procfs!\n");
+    }
     return 0;
 }
 
-EXPORT_SYMBOL(seven_segment_register_top_proc_dir);
+static void seven_segment_remove_top_proc_dir(void) {
+    struct seven_segment_group *group, *tmp;
+    LIST_HEAD(groups);
+
+    mutex_lock(&seven_segment_registry_lock);
+    list_splice_init(&seven_segment_groups, &groups);
+    mutex_unlock(&seven_segment_registry_lock);
+
+    list_for_each_entry_safe(group, tmp, &groups, node)
+        seven_segment_destroy_group(group);
+
+    proc_remove(procparent);
+    debugfs_remove_recursive(debugfsparent);
+    debugfsparent = NULL;
+    procparent = NULL;
+    groupsparent = NULL;
+    busesparent = NULL;
+    statefile = NULL;
+}
+
+// The core owns /proc/ssd and everything below it, the transport modules only add displays.
+static int __init seven_segment_core_init(void){
+    int ret;
+
+    ret = seven_segment_register_top_proc_dir();
+    if (ret)
+        seven_segment_remove_top_proc_dir();
+    return ret;
+}
+
+static void __exit seven_segment_core_exit(void){
+    seven_segment_remove_top_proc_dir();
+    idr_destroy(&seven_segment_idr);
+}
+
+module_init(seven_segment_core_init);
+module_exit(seven_segment_core_exit);
 
+// The tests need the static functions, they are built into the core with "make SSD_KUNIT=1"
+#if defined(SEVENSEGMENT_KUNIT) && IS_ENABLED(CONFIG_KUNIT)
+#include "7-segment-test.c"
+#endif
 MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Gyorgy Sarvari");
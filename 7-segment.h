@@ -2,12 +2,68 @@
 #define SEVENSEGMENT_H
 
 #include <linux/types.h>
+#include <linux/bits.h>
 #include <linux/of.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/workqueue.h>
+#include <linux/miscdevice.h>
+#include <linux/atomic.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/hrtimer.h>
+#include <linux/wait.h>
 
-#define SEVENSEGMENT_MAX_CLIENTS    3
+#include "7-segment-ioctl.h"
+
+#define SEVENSEGMENT_DIGITS         4
+
+#define SEVENSEGMENT_GROUP_NAME_MAX     32
+#define SEVENSEGMENT_GROUP_MAX_MEMBERS  64
+#define SEVENSEGMENT_GROUP_TEXT_MAX     512
+// brightness, clear, custom_digit1-4, decimals, text
+#define SEVENSEGMENT_GROUP_FILES        8
+
+#define SEVENSEGMENT_SCROLL_MAX         128
+// longest value accepted by an attribute: a scroll text and a newline
+#define SEVENSEGMENT_WRITE_MAX          (SEVENSEGMENT_SCROLL_MAX + 1)
+#define SEVENSEGMENT_DEFAULT_SCROLL_SPEED   300 // ms per step
+#define SEVENSEGMENT_MIN_SCROLL_SPEED       20
+#define SEVENSEGMENT_MAX_SCROLL_SPEED       10000
+
+// room for a running animation, and another one appended to it
+#define SEVENSEGMENT_ANIM_MAX           (2 * SSD_ANIM_MAX_FRAMES)
+#define SEVENSEGMENT_ANIM_MIN_DURATION  10 // ms
+#define SEVENSEGMENT_ANIM_MAX_DURATION  60000
+
+#define SEVENSEGMENT_NUMBER_MAX_PRECISION   (SEVENSEGMENT_DIGITS - 1)
+// larger values don't fit on the display anyway
+#define SEVENSEGMENT_NUMBER_LIMIT           1000000000ULL
+
+#define SEVENSEGMENT_RETRY_MIN     10   // ms after the first failure, doubled after every other
+#define SEVENSEGMENT_RETRY_MAX     5000
+#define SEVENSEGMENT_MAX_RETRIES   6    // failures before the display is considered offline
+
+#define SEVENSEGMENT_DIMMER_STEP            20 // ms between two fade steps
+#define SEVENSEGMENT_DEFAULT_FADE_DURATION  1000 // ms
+#define SEVENSEGMENT_MAX_FADE_DURATION      60000
+
+#define SEVENSEGMENT_SOURCE_NAME_MAX        32
+#define SEVENSEGMENT_DEFAULT_SOURCE_INTERVAL    1000 // ms
+#define SEVENSEGMENT_MIN_SOURCE_INTERVAL        10
+#define SEVENSEGMENT_MAX_SOURCE_INTERVAL        3600000
+
+#define SEVENSEGMENT_DEFAULT_REFRESH_RATE   50 // Hz
+#define SEVENSEGMENT_MAX_REFRESH_RATE       1000
+
+// bits of the decimals command beyond the decimal points
+#define SEVENSEGMENT_DECIMAL_COLON  BIT(4)
+#define SEVENSEGMENT_CLOCK_MAX_COUNTDOWN    (100 * 3600 - 1) // s, 99:59 in HH:MM
 
 #define SEVENSEGMENT_CLEAR_SCREEN   0x76
 #define SEVENSEGMENT_DECIMAL_CTRL   0x77
+#define SEVENSEGMENT_CURSOR_CTRL    0x79
 #define SEVENSEGMENT_BRIGHTNESS     0x7a
 #define SEVENSEGMENT_DIGIT_1        0x7b
 #define SEVENSEGMENT_DIGIT_2        0x7c
@@ -15,42 +71,332 @@
 #define SEVENSEGMENT_DIGIT_4        0x7e
 #define SEVENSEGMENT_FACTORY_RESET  0x81
 
+// longest update: clear, cursor + character for every digit, decimals and brightness
+#define SEVENSEGMENT_FRAME_MAX      (1 + 3 * SEVENSEGMENT_DIGITS + 2 + 2)
+
+#define SEVENSEGMENT_DIRTY_CELL(i)      BIT(i)
+
+// latency histogram buckets: <1us, then [2^(i-1), 2^i) us, the last one is open ended
+#define SEVENSEGMENT_LATENCY_BUCKETS 16
+
+#define SEVENSEGMENT_DIRTY_CELLS        (BIT(SEVENSEGMENT_DIGITS) - 1)
+#define SEVENSEGMENT_DIRTY_DECIMALS     BIT(SEVENSEGMENT_DIGITS)
+#define SEVENSEGMENT_DIRTY_BRIGHTNESS   BIT(SEVENSEGMENT_DIGITS + 1)
+#define SEVENSEGMENT_DIRTY_FRAME        (BIT(SEVENSEGMENT_DIGITS + 2) - 1)
+#define SEVENSEGMENT_DIRTY_CLEAR        BIT(SEVENSEGMENT_DIGITS + 2)
+
 enum SevenSegmentProcFile {
+    SEVENSEGMENT_BLINK_FILE,
     SEVENSEGMENT_BRIGHTNESS_FILE,
     SEVENSEGMENT_CLEAR_FILE,
+    SEVENSEGMENT_CLOCK_FILE,
+    SEVENSEGMENT_COMMIT_FILE,
     SEVENSEGMENT_CUSTOM_DIGIT1_FILE,
     SEVENSEGMENT_CUSTOM_DIGIT2_FILE,
     SEVENSEGMENT_CUSTOM_DIGIT3_FILE,
     SEVENSEGMENT_CUSTOM_DIGIT4_FILE,
     SEVENSEGMENT_DECIMALS_FILE,
+    SEVENSEGMENT_FADE_FILE,
+    SEVENSEGMENT_HEALTH_FILE,
     SEVENSEGMENT_NAME_FILE,
+    SEVENSEGMENT_NUMBER_FILE,
+    SEVENSEGMENT_PRIORITY_FILE,
+    SEVENSEGMENT_REFRESH_RATE_FILE,
+    SEVENSEGMENT_SCROLL_FILE,
+    SEVENSEGMENT_SCROLL_MODE_FILE,
+    SEVENSEGMENT_SCROLL_SPEED_FILE,
+    SEVENSEGMENT_SOURCE_FILE,
     SEVENSEGMENT_TEXT_FILE,
     SEVENSEGMENT_UNKNOWN_FILE
 };
 
+// Kernel driven content of the digits. Writing the digits directly stops it.
+enum SevenSegmentEffect {
+    SEVENSEGMENT_EFFECT_NONE,
+    SEVENSEGMENT_EFFECT_SCROLL,
+    SEVENSEGMENT_EFFECT_ANIMATION,
+    SEVENSEGMENT_EFFECT_CLOCK
+};
+
+enum SevenSegmentScrollMode {
+    SEVENSEGMENT_SCROLL_ONCE,   // stop when the end of the text is reached
+    SEVENSEGMENT_SCROLL_LOOP,   // start over, after the text scrolled out
+    SEVENSEGMENT_SCROLL_BOUNCE  // scroll back and forth
+};
+
 enum SevenSegmentDeviceType {
     SEVENSEGMENT_I2C,
-    SEVENSEGMENT_SPI
+    SEVENSEGMENT_SPI,
+    SEVENSEGMENT_VIRTUAL
 };
 
 typedef union {
     struct i2c_client *i2c;
     struct spi_device *spi;
+    struct platform_device *pdev;
 } client_type;
 
+struct seven_segment_display;
+struct seven_segment_group;
+struct iio_channel;
+
+// How the core talks to a display. Everything specific to the bus goes through here.
+struct seven_segment_transport {
+    enum SevenSegmentDeviceType type;
+    bool async;                         // send() only queues, the transport accounts the completion
+    // optional, called when the display is registered and released
+    int (*setup)(struct seven_segment_display *ssd);
+    void (*teardown)(struct seven_segment_display *ssd);
+    // returns len, or a negative errno
+    int (*send)(struct seven_segment_display *ssd, char *cmd, size_t len, unsigned long sent);
+    // optional, sends the prepared updates in group->batch[first, last) as one batch
+    void (*group_send)(struct seven_segment_group *group, int first, int last);
+    void *(*bus_adapter)(struct seven_segment_display *ssd);   // displays with the same one share a bus
+    void (*bus_name)(struct seven_segment_display *ssd, char *name, size_t sz);
+    const char *(*name)(struct seven_segment_display *ssd);
+    struct device *(*dev)(struct seven_segment_display *ssd);
+    // optional, adds transport specific files to the display's debugfs directory
+    void (*debugfs)(struct seven_segment_display *ssd);
+};
+
+struct seven_segment_proc_file {
+    struct seven_segment_display *ssd;
+    enum SevenSegmentProcFile type;
+};
+
+struct seven_segment_group_file {
+    struct seven_segment_group *group;
+    enum SevenSegmentProcFile type;
+};
+
+// Displays sharing an i2c adapter or spi controller. Transfers to them are serialized, and
+// scheduled by the bus work: fairly between the displays, and within the bus' limits.
+struct seven_segment_bus {
+    struct list_head node;
+    void *adapter;                      // from transport->bus_adapter()
+    const struct seven_segment_transport *transport;
+    char name[16];                      // /proc/ssd/buses/<name>
+    struct proc_dir_entry *procfolder;
+    int users;
+    struct mutex lock;                  // held while sending, protects the budgets
+    spinlock_t queue_lock;
+    struct list_head queue;             // displays waiting for an update, round-robin
+    struct list_head urgent;            // served before queue
+    struct delayed_work work;
+    unsigned int max_bytes;             // per second, 0 is unlimited
+    unsigned int max_transfers;         // per second, 0 is unlimited
+    s64 byte_budget;
+    s64 transfer_budget;
+    ktime_t last_refill;
+};
+
+enum SevenSegmentClockMode {
+    SEVENSEGMENT_CLOCK_HHMM,        // wall clock, hours and minutes
+    SEVENSEGMENT_CLOCK_MMSS,        // wall clock, minutes and seconds
+    SEVENSEGMENT_CLOCK_STOPWATCH,   // time since start
+    SEVENSEGMENT_CLOCK_COUNTDOWN    // time left until the end, stops at 00:00
+};
+
+struct seven_segment_clock {
+    enum SevenSegmentClockMode mode;
+    ktime_t base;                       // CLOCK_MONOTONIC start of the stopwatch, end of the countdown
+};
+
+enum SevenSegmentHealth {
+    SEVENSEGMENT_HEALTH_OK,
+    SEVENSEGMENT_HEALTH_RETRYING,   // the last updates failed, retried with backoff
+    SEVENSEGMENT_HEALTH_OFFLINE     // failed too many times, probed at the slowest retry rate
+};
+
+enum SevenSegmentDimmerMode {
+    SEVENSEGMENT_DIMMER_NONE,
+    SEVENSEGMENT_DIMMER_FADE,
+    SEVENSEGMENT_DIMMER_BLINK
+};
+
+enum SevenSegmentFadeCurve {
+    SEVENSEGMENT_FADE_LINEAR,
+    SEVENSEGMENT_FADE_EASE_IN,
+    SEVENSEGMENT_FADE_EASE_OUT,
+    SEVENSEGMENT_FADE_EASE_IN_OUT
+};
+
+enum SevenSegmentBlinkPattern {
+    SEVENSEGMENT_BLINK_SLOW,
+    SEVENSEGMENT_BLINK_FAST,
+    SEVENSEGMENT_BLINK_HEARTBEAT,
+    SEVENSEGMENT_BLINK_PATTERNS
+};
+
+// Drives the brightness independently of the content effects. Fades run on the perceived
+// brightness, which is mapped to the display's level through a gamma table.
+struct seven_segment_dimmer {
+    enum SevenSegmentDimmerMode mode;
+    enum SevenSegmentFadeCurve curve;
+    ktime_t start;
+    unsigned int duration;              // ms
+    u8 from;                            // perceived brightness at the start of the fade
+    u8 to;                              // perceived brightness at the end of the fade
+    u8 target;                          // brightness set when the fade is over
+    enum SevenSegmentBlinkPattern pattern;
+    int step;                           // index in the pattern, even steps are on
+    u8 high;                            // brightness of the on steps
+    u8 low;                             // brightness of the off steps
+};
+
+enum SevenSegmentSourceType {
+    SEVENSEGMENT_SOURCE_NONE,
+    SEVENSEGMENT_SOURCE_THERMAL,    // thermal zone, by type
+    SEVENSEGMENT_SOURCE_IIO         // iio channel, by the consumer name given to the display
+};
+
+enum SevenSegmentOverflow {
+    SEVENSEGMENT_OVERFLOW_DASHES,   // show "----"
+    SEVENSEGMENT_OVERFLOW_ERROR     // reject the write with -ERANGE
+};
+
+// Formatting options of the number file, they stay set for the following writes.
+struct seven_segment_number {
+    unsigned int precision;             // digits after the decimal point
+    bool left;                          // left aligned, instead of right
+    bool zeros;                         // pad with leading zeros instead of blanks
+    enum SevenSegmentOverflow overflow;
+};
+
+// A value sampled periodically, and shown as a number. The work reads the sensor without write_lock,
+// with a copy of the binding, and drops the value if the generation changed in the meantime.
+struct seven_segment_source {
+    enum SevenSegmentSourceType type;
+    char name[SEVENSEGMENT_SOURCE_NAME_MAX];
+    struct iio_channel *chan;
+    struct iio_channel *sampled;        // chan being read by the work, it releases it if unbound meanwhile
+    unsigned int generation;            // changed by every bind and unbind
+    unsigned int interval;              // ms
+    int div;                            // the value shown is raw / div
+    struct seven_segment_number number; // formatting, taken from the number file when bound
+    struct delayed_work work;
+};
+
+struct seven_segment_scroll {
+    char text[SEVENSEGMENT_SCROLL_MAX + 1];
+    int len;
+    int pos;                            // index of the text shown on the first digit
+    int dir;                            // 1 or -1, for bouncing
+    unsigned int speed;                 // ms per step
+    enum SevenSegmentScrollMode mode;
+};
+
+// Ring of frames played by the effect timer. In loop mode frames[head + cur] is shown,
+// otherwise frames[head], and played frames are dropped.
+struct seven_segment_animation {
+    struct ssd_anim_frame frames[SEVENSEGMENT_ANIM_MAX];
+    int head;
+    int cur;
+    int count;
+    bool loop;
+};
+
+// Content of the panel. A cell either holds a character, or a custom segment bitmap.
+struct seven_segment_frame {
+    uint8_t cells[SEVENSEGMENT_DIGITS];
+    uint8_t chars; // bit i is set if cells[i] is a character
+    uint8_t decimals;
+    uint8_t brightness;
+};
+
+// Per-cpu counters of a display, shown in debugfs.
+struct seven_segment_stats {
+    u64 commands;
+    u64 bytes;
+    u64 errors;
+    u64 coalesced;                      // updates merged into an already pending flush
+    u64 skipped;                        // flushes with nothing left to send
+    u64 latency[SEVENSEGMENT_LATENCY_BUCKETS];
+};
+
 struct seven_segment_display{
     client_type device;
-    enum SevenSegmentDeviceType device_type;
-    char text[5];
-    uint8_t digit1;
-    uint8_t digit2;
-    uint8_t digit3;
-    uint8_t digit4;
-    uint8_t brightness;
-    uint8_t decimals;
+    const struct seven_segment_transport *transport;
+    int idx;                            // N in /proc/ssd/N and /dev/ssdN
+    struct seven_segment_bus *bus;
+    struct list_head bus_node;          // in bus->queue or bus->urgent, protected by bus->queue_lock
+    bool priority;                      // updates always jump the queue of the bus
+    bool urgent;                        // the pending update jumps the queue of the bus
+    struct seven_segment_frame fb;      // requested state
+    struct seven_segment_frame shadow;  // what the panel actually shows
+    unsigned long synced;               // SEVENSEGMENT_DIRTY_* bits of shadow that are known
+    unsigned long dirty;                // SEVENSEGMENT_DIRTY_* bits that differ between fb and shadow
+    spinlock_t lock;                    // protects fb, shadow, synced, dirty and the kernel's writes to shared
+    seqcount_spinlock_t state_seq;      // lets readers copy state, scroll.text and the source binding without the lock
+    struct ssd_frame state;             // the current frame, as published to the readers
+    u64 generation;                     // number of changes of state, protected like state
+    wait_queue_head_t change_wait;      // pollers of /dev/ssdN, woken up when state changes
+    struct delayed_work flush_work;
+    unsigned long last_flush;           // jiffies
+    enum SevenSegmentHealth health;     // protected by lock
+    unsigned int failures;              // consecutive failed updates, protected by lock
+    unsigned long retry_at;             // jiffies, no flush before this while failing
+    unsigned int refresh_rate;          // max updates per second, 0 is unlimited
+    struct miscdevice miscdev;          // /dev/ssdN
+    char miscname[16];
+    struct ssd_shared *shared;          // mmap-able page, always holding the current frame
+    u32 shared_seq;                     // seq the kernel last wrote or applied, protected by lock
+    atomic_t mappers;
+    struct kref ref;                    // held by the transport, and the open files and mappings of /dev/ssdN
+    bool dead;                          // unregistered, set under write_lock, the flush path reads it locklessly
+    struct delayed_work refresh_work;   // polls the shared page while it's mapped
+    enum SevenSegmentEffect effect;     // protected by lock
+    struct hrtimer effect_timer;
+    struct seven_segment_scroll scroll; // protected by lock
+    struct seven_segment_number number; // protected by write_lock
+    struct seven_segment_clock clock;   // protected by lock
+    struct seven_segment_source source; // protected by write_lock
+    struct seven_segment_animation anim;    // protected by lock
+    struct seven_segment_dimmer dimmer; // protected by lock
+    struct hrtimer dimmer_timer;
+    struct mutex write_lock;            // serializes the writers of the display, protects write_buf
+    char write_buf[SEVENSEGMENT_WRITE_MAX + 1];
+    struct seven_segment_stats __percpu *stats;
+    struct dentry *debugfs;             // <debugfs>/ssd/N
     struct proc_dir_entry *procfolder;
+    struct seven_segment_proc_file files[SEVENSEGMENT_UNKNOWN_FILE];
 };
 
+// An open /dev/ssdN.
+struct seven_segment_reader {
+    struct seven_segment_display *ssd;
+    u64 seen;                           // generation returned by the last read
+};
+
+struct seven_segment_group_member {
+    struct seven_segment_display *ssd;
+    unsigned long sent;
+    size_t len;
+    char buf[SEVENSEGMENT_FRAME_MAX];
+};
+
+// Displays updated together through /proc/ssd/groups/<name>. Members are sorted by bus.
+struct seven_segment_group {
+    struct list_head node;
+    char name[SEVENSEGMENT_GROUP_NAME_MAX];
+    struct proc_dir_entry *procfolder;
+    struct seven_segment_group_file files[SEVENSEGMENT_GROUP_FILES];
+    struct work_struct flush_work;
+    char write_buf[SEVENSEGMENT_WRITE_MAX + 1];
+    int count;
+    struct seven_segment_group_member members[SEVENSEGMENT_GROUP_MAX_MEMBERS];
+    struct seven_segment_group_member batch[SEVENSEGMENT_GROUP_MAX_MEMBERS];  // owned by flush_work
+};
+
+// Exported by ssd-core.ko, for the transports.
+int seven_segment_init_display(struct seven_segment_display *ssd);
+void seven_segment_release_display(struct seven_segment_display *ssd);
+void seven_segment_put_display(struct seven_segment_display *ssd);
+int seven_segment_register_display(struct seven_segment_display *ssd);
+void seven_segment_unregister_display(struct seven_segment_display *ssd);
+void seven_segment_account(struct seven_segment_display *ssd, const void *cmd, size_t len, int ret, u64 start);
+void seven_segment_update_failed(struct seven_segment_display *ssd, unsigned long sent);
+
 static const struct of_device_id seven_segment_match[] = {
     { .compatible = "sparkfun,7segment" },
     { }